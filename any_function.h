@@ -47,66 +47,378 @@
 #ifndef ANY_FUNCTION_H
 #define ANY_FUNCTION_H
 
+#include <algorithm>    // For std::min(...)
+#include <atomic>       // For std::atomic<T>
 #include <cassert>      // For assert(...)
+#include <cstddef>      // For std::size_t
+#include <cstdint>      // For std::uintptr_t
+#include <cstring>      // For std::memcpy(...)
+#include <exception>    // For std::exception_ptr
 #include <functional>   // For std::function<F>
+#include <memory>       // For std::allocator_arg_t
+#include <new>          // For placement new
+#include <stdexcept>    // For std::invalid_argument
+#include <system_error> // For std::system_error
+#include <thread>       // For std::thread
+#include <tuple>        // For std::tuple<T...>
+#include <type_traits>  // For std::aligned_storage<N, A>, std::is_nothrow_move_constructible<T>
+#include <typeinfo>     // For std::type_info
 #include <vector>       // For std::vector<T>
-#include <memory>       // For std::unique_ptr<T>
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource> // For std::pmr::memory_resource
+#define ANY_FUNCTION_HAS_PMR
+#endif
+#endif
+
+// libstdc++ before GCC 5, which is recognised by not defining _GLIBCXX_USE_CXX11_ABI, lacks std::is_trivially_copyable<T>, so the
+// compiler's own traits stand in for it there
+#if defined(__GLIBCXX__) && !defined(_GLIBCXX_USE_CXX11_ABI)
+#define ANY_FUNCTION_IS_TRIVIALLY_COPYABLE(T) (__has_trivial_copy(T) && __has_trivial_destructor(T))
+#else
+#define ANY_FUNCTION_IS_TRIVIALLY_COPYABLE(T) std::is_trivially_copyable<T>::value
+#endif
+
+// Size in bytes of the inline buffer used by any_function to hold its callable. Function pointers, small lambdas and
+// std::function objects fit without a heap allocation.
+#ifndef ANY_FUNCTION_INLINE_SIZE
+#define ANY_FUNCTION_INLINE_SIZE (4*sizeof(void *))
+#endif
+
+// Size in bytes of the inline buffer used by any_function::result. Return values which fit (and are nothrow movable) are
+// stored without a heap allocation. References are always stored inline.
+#ifndef ANY_FUNCTION_RESULT_INLINE_SIZE
+#define ANY_FUNCTION_RESULT_INLINE_SIZE (4*sizeof(void *))
+#endif
+
+// Unless an any_function::memory_resource is supplied, every heap allocation made by any_function and any_function::result is
+// obtained from ANY_FUNCTION_ALLOCATE(size, alignment) and released with ANY_FUNCTION_DEALLOCATE(p, size, alignment). Define both
+// before including this header to route them through a custom allocator, which must return storage aligned to alignment. By
+// default, over-aligned types are allocated with the aligned operator new where the compiler provides it, and otherwise carved
+// out of a larger block from plain operator new.
+#ifndef ANY_FUNCTION_ALLOCATE
+#define ANY_FUNCTION_ALLOCATE(size, alignment) any_function::default_allocate(size, alignment)
+#define ANY_FUNCTION_DEALLOCATE(p, size, alignment) any_function::default_deallocate(p, size, alignment)
+#endif
+
+// Define ANY_FUNCTION_SHARE_HEAP_CALLABLES as 1 to have copies of an any_function share a const invocable callable which lives on
+// the heap, rather than copying it, by counting references to it. Mutable callables are always copied, as calls may modify them.
+#ifndef ANY_FUNCTION_SHARE_HEAP_CALLABLES
+#define ANY_FUNCTION_SHARE_HEAP_CALLABLES 0
+#endif
+
+// Define ANY_FUNCTION_COUNT_ALLOCATIONS before including this header to have any_function keep per-thread counts of its heap
+// allocations, which can be read via any_function::get_allocation_counters().
+
+// Writes values of type T to a byte buffer for any_function::invoke_serialized(...). Trivially copyable types are written as their
+// bytes. Specialize this template, with a member of the same form as serialize(...) below, to make other types serializable.
+template<class T, class Enable = void> struct any_function_serializer {};
+template<class T> struct any_function_serializer<T, typename std::enable_if<ANY_FUNCTION_IS_TRIVIALLY_COPYABLE(T)>::type>
+{
+    // Writes value to out, which has room for capacity bytes, and returns the number of bytes written. Throws std::length_error
+    // if value does not fit.
+    static std::size_t                                  serialize(const T & value, void * out, std::size_t capacity) { if(capacity < sizeof(T)) throw std::length_error("any_function_serializer::serialize: buffer too small"); std::memcpy(out, &value, sizeof(T)); return sizeof(T); }
+};
 
 struct any_function
 {
 public:
+    // Describes a parameter or result type as a single word: the address of a record interned per unqualified type, whose low
+    // four bits (always zero, as records are 16-byte aligned) hold the reference and cv-qualifiers. Types can be compared and
+    // hashed as plain integers. A default constructed type, describing no type at all, is zero. Unlike the word itself, which
+    // depends on where the record was placed in memory, fingerprint() is an FNV-1a hash of the type name and qualifiers, which
+    // is the same from run to run of a given build.
     struct type 
     { 
-        const std::type_info *                          info; 
-        bool                                            is_lvalue_reference, is_rvalue_reference;
-        bool                                            is_const, is_volatile; 
-        bool                                            operator == (const type & r) const                      { return info==r.info && is_lvalue_reference==r.is_lvalue_reference && is_rvalue_reference==r.is_rvalue_reference && is_const==r.is_const && is_volatile==r.is_volatile; }
-        bool                                            operator != (const type & r) const                      { return !(*this == r); }
-        template<class T> static type                   capture()                                               { return {&typeid(T), std::is_lvalue_reference<T>::value, std::is_rvalue_reference<T>::value, std::is_const<typename std::remove_reference<T>::type>::value, std::is_volatile<typename std::remove_reference<T>::type>::value}; }
+        std::uintptr_t                                  bits;
+
+        const std::type_info *                          info() const                                            { return bits ? reinterpret_cast<const record *>(bits & ~qualifier_mask)->info : nullptr; }
+        bool                                            is_lvalue_reference() const                             { return (bits & lvalue_reference_bit) != 0; }
+        bool                                            is_rvalue_reference() const                             { return (bits & rvalue_reference_bit) != 0; }
+        bool                                            is_const() const                                        { return (bits & const_bit) != 0; }
+        bool                                            is_volatile() const                                     { return (bits & volatile_bit) != 0; }
+        type                                            unqualified() const                                     { return {bits & ~qualifier_mask}; }
+        bool                                            operator == (const type & r) const                      { return bits == r.bits; }
+        bool                                            operator != (const type & r) const                      { return bits != r.bits; }
+        std::uint64_t                                   fingerprint(std::uint64_t h = fnv_offset_basis) const   { if(!bits) return h; for(auto n = info()->name(); *n; ++n) h = fnv(h, *n); return fnv(fnv(h, 0), bits & qualifier_mask); }
+        template<class T> static type                   capture()                                               { return {reinterpret_cast<std::uintptr_t>(record::of<typename std::remove_cv<typename std::remove_reference<T>::type>::type>()) | qualifiers<T>()}; }
+    private:
+        struct alignas(16) record 
+        { 
+            const std::type_info *                      info;
+            template<class U> static const record *     of()                                                    { static const record r = {&typeid(U)}; return &r; }
+        };
+        static const std::uint64_t                      fnv_offset_basis = 14695981039346656037ull, fnv_prime = 1099511628211ull;
+        static std::uint64_t                            fnv(std::uint64_t h, std::uintptr_t byte)               { return (h ^ (byte & 0xFF)) * fnv_prime; }
+        static const std::uintptr_t                     lvalue_reference_bit = 1, rvalue_reference_bit = 2, const_bit = 4, volatile_bit = 8, qualifier_mask = 15;
+        template<class T> static std::uintptr_t         qualifiers()                                            { typedef typename std::remove_reference<T>::type U; return (std::is_lvalue_reference<T>::value ? lvalue_reference_bit : 0) | (std::is_rvalue_reference<T>::value ? rvalue_reference_bit : 0) | (std::is_const<U>::value ? const_bit : 0) | (std::is_volatile<U>::value ? volatile_bit : 0); }
+    };
+
+    // Source of memory for the heap allocations of any_function and any_function::result, modelled on std::pmr::memory_resource.
+    // Callables and results constructed with a memory_resource remember it, and return their memory to it when destroyed.
+    class memory_resource
+    {
+    public:
+        virtual                                         ~memory_resource()                                      {}
+        virtual void *                                  allocate(std::size_t size, std::size_t alignment) = 0;
+        virtual void                                    deallocate(void * p, std::size_t size, std::size_t alignment) = 0;
+    };
+#ifdef ANY_FUNCTION_HAS_PMR
+    // Adapts a std::pmr::memory_resource, such as a std::pmr::monotonic_buffer_resource, for use with any_function
+    class pmr_resource : public memory_resource
+    {
+        std::pmr::memory_resource *                     upstream;
+    public:
+        explicit                                        pmr_resource(std::pmr::memory_resource * upstream)      : upstream(upstream) {}
+        void *                                          allocate(std::size_t size, std::size_t alignment)       { return upstream->allocate(size, alignment); }
+        void                                            deallocate(void * p, std::size_t size, std::size_t alignment) { upstream->deallocate(p, size, alignment); }
     };
+#endif
+    static memory_resource *                            default_resource()                                      { static default_memory_resource r; return &r; }
 
     class result
     {
-        struct result_base
+        friend struct any_function;
+        struct ops
         {
-            virtual                                     ~result_base()                                          {}
-            virtual std::unique_ptr<result_base>        clone() const                                           = 0;
-            virtual type                                get_type() const                                        = 0;
-            virtual void *                              get_address()                                           = 0;     
+            void *                                      (*allocate)(result & r, memory_resource * m);
+            void                                        (*deallocate)(result & r);
+            type                                        (*get_type)();
+            void *                                      (*get_address)(const result & r);
+            void                                        (*copy)(const result & from, result & to, memory_resource * m);
+            void                                        (*move)(result & from, result & to);
+            void                                        (*destroy)(result & r);
         };
-        template<class T> struct typed_result : result_base
+
+        // Results are held as their own value, except for references, which are held as pointers to their referent
+        template<class T> struct holder                 { typedef T value_type; template<class V> static void construct(void * p, V && v) { new(p) T(std::forward<V>(v)); } static void * address(T & x) { return (void *)&x; } };
+        template<class T> struct holder<T &>            { typedef T * value_type; template<class V> static void construct(void * p, V && v) { new(p) T *(&v); } static void * address(T * x) { return (void *)x; } };
+        template<class T> struct holder<T &&>           { typedef T * value_type; template<class V> static void construct(void * p, V && v) { new(p) T *(&v); } static void * address(T * x) { return (void *)x; } };
+
+        // Small, nothrow-movable values are stored inline, everything else lives on the heap
+        typedef typename std::aligned_storage<ANY_FUNCTION_RESULT_INLINE_SIZE, alignof(void *)>::type buffer_type;
+        template<class S> struct fits_inline            : std::integral_constant<bool, sizeof(S) <= sizeof(buffer_type) && alignof(S) <= alignof(buffer_type) && std::is_nothrow_move_constructible<S>::value> {};
+        template<class T, class S = typename holder<T>::value_type, bool Inline = fits_inline<S>::value> struct typed_ops
         {
-            T                                           x;
-                                                        typed_result(T x)                                       : x(get((void*)&x, tag<T>{})) {}
-            std::unique_ptr<result_base>                clone() const                                           { return std::unique_ptr<typed_result>(new typed_result(get((void*)&x, tag<T>{}))); }
-            type                                        get_type() const                                        { return type::capture<T>(); }
-            void *                                      get_address()                                           { return (void *)&x; }
+            static S &                                  get(const result & r)                                   { return *(S *)&r.buffer; }
+            static void *                               allocate(result & r, memory_resource *)                 { return &r.buffer; }
+            static void                                 deallocate(result &)                                    {}
+            static type                                 get_type()                                              { return type::capture<T>(); }
+            static void *                               get_address(const result & r)                           { return holder<T>::address(get(r)); }
+            static void                                 copy(const result & from, result & to, memory_resource *) { new(&to.buffer) S(get(from)); }
+            static void                                 move(result & from, result & to)                        { new(&to.buffer) S(std::move(get(from))); destroy(from); }
+            static void                                 destroy(result & r)                                     { get(r).~S(); }
+            static const ops *                          table()                                                 { static const ops t = {&allocate, &deallocate, &get_type, &get_address, &copy, &move, &destroy}; return &t; }
         };
-        std::unique_ptr<result_base>                    p;
+        template<class T, class S> struct typed_ops<T, S, false>
+        {
+            static S *&                                 ptr(const result & r)                                   { return *(S **)&r.buffer; }
+            static void *                               allocate(result & r, memory_resource * m)               { return ptr(r) = (S *)heap_block<S>::allocate(m); }
+            static void                                 deallocate(result & r)                                  { heap_block<S>::deallocate(ptr(r)); }
+            static type                                 get_type()                                              { return type::capture<T>(); }
+            static void *                               get_address(const result & r)                           { return holder<T>::address(*ptr(r)); }
+            static void                                 copy(const result & from, result & to, memory_resource * m) { void * p = allocate(to, m); try { new(p) S(*ptr(from)); } catch(...) { deallocate(to); throw; } }
+            static void                                 move(result & from, result & to)                        { ptr(to) = ptr(from); }
+            static void                                 destroy(result & r)                                     { ptr(r)->~S(); deallocate(r); }
+            static const ops *                          table()                                                 { static const ops t = {&allocate, &deallocate, &get_type, &get_address, &copy, &move, &destroy}; return &t; }
+        };
+        template<class T> static const ops *            table(std::false_type)                                  { return typed_ops<T>::table(); }
+        template<class T> static const ops *            table(std::true_type)                                   { return nullptr; }
+
+        // Allocates storage for a value described by t, then calls init(p) to construct the held value at p
+        template<class F> static result                 emplace(const ops * t, memory_resource * m, F && init)  { result r; if(!t) return init(nullptr), r; void * p = t->allocate(r, m); try { init(p); } catch(...) { t->deallocate(r); throw; } r.vt = t; return r; }
+
+        const ops *                                     vt;
+        buffer_type                                     buffer;
+    public:
+                                                        result()                                                : vt() {}
+                                                        result(result && r) noexcept                            : vt(r.vt) { if(vt) vt->move(r, *this); r.vt = nullptr; }
+                                                        result(const result & r)                                : result(std::allocator_arg, default_resource(), r) {}
+                                                        result(std::allocator_arg_t, memory_resource * m, const result & r) : vt() { if(r.vt) r.vt->copy(r, *this, m); vt = r.vt; }
+                                                        ~result()                                               { reset(); }
+        result &                                        operator = (result && r) noexcept                       { if(this != &r) { reset(); if(r.vt) r.vt->move(r, *this); vt = r.vt; r.vt = nullptr; } return *this; }
+        result &                                        operator = (const result & r)                           { return *this = result(r); }
+
+        type                                            get_type() const                                        { return vt ? vt->get_type() : type::capture<void>(); }
+        void *                                          get_address()                                           { return vt ? vt->get_address(*this) : nullptr; }
+        template<class T> T                             get_value()                                             { assert(get_type() == type::capture<T>()); return get(get_address(), tag<T>{}); }
+        void                                            reset()                                                 { if(vt) vt->destroy(*this); vt = nullptr; }
+
+        template<class T> static result                 capture(T x)                                            { return capture<T>(default_resource(), std::forward<T>(x)); }
+        template<class T> static result                 capture(memory_resource * m, T x)                       { return emplace(table<T>(std::is_void<T>{}), m, [&](void * p) { holder<T>::construct(p, std::forward<T>(x)); }); }
+    };
+
+    // A strided array of objects, such as one column of a structure-of-arrays table, where element i is located at data + i*stride bytes
+    struct column
+    {
+        void *                                          data;
+        std::ptrdiff_t                                  stride;
+        void *                                          operator [] (std::size_t i) const                       { return static_cast<char *>(data) + static_cast<std::ptrdiff_t>(i) * stride; }
+    };
+
+    class type_list
+    {
+        const type *                                    first, * last;
     public:
-                                                        result()                                                {}
-                                                        result(result && r)                                     : p(move(r.p)) {}
-                                                        result(const result & r)                                { *this = r; }
-        result &                                        operator = (result && r)                                { p.swap(r.p); return *this; }
-        result &                                        operator = (const result & r)                           { p = r.p ? r.p->clone() : nullptr; return *this; }
-
-        type                                            get_type() const                                        { return p ? p->get_type() : type::capture<void>(); }
-        void *                                          get_address()                                           { return p ? p->get_address() : nullptr; }
-        template<class T> T                             get_value()                                             { assert(get_type() == type::capture<T>()); return get(p->get_address(), tag<T>{}); }
-
-        template<class T> static result                 capture(T x)                                            { result r; r.p.reset(new typed_result<T>(static_cast<T>(x))); return r; }
-    };
-                                                        any_function()                                          : result_type{} {}
-                                                        any_function(std::nullptr_t)                            : result_type{} {}
-    template<class R, class... A>                       any_function(R (*p)(A...))                              : any_function(p, tag<R>{}, tag<A...>{}, build_indices<sizeof...(A)>{}) {} 
-    template<class R, class... A>                       any_function(std::function<R(A...)> f)                  : any_function(f, tag<R>{}, tag<A...>{}, build_indices<sizeof...(A)>{}) {} 
-    template<class F>                                   any_function(F f)                                       : any_function(f, &F::operator()) {}   
-
-    explicit                                            operator bool() const                                   { return static_cast<bool>(func); }
-    const std::vector<type> &                           get_parameter_types() const                             { return parameter_types; }
-    const type &                                        get_result_type() const                                 { return result_type; }
-    result                                              invoke(void * const args[]) const                       { return func(args); }
+                                                        type_list(const type * first, const type * last)        : first(first), last(last) {}
+
+        const type *                                    begin() const                                           { return first; }
+        const type *                                    end() const                                             { return last; }
+        std::size_t                                     size() const                                            { return last - first; }
+        bool                                            empty() const                                           { return first == last; }
+        const type &                                    operator [] (std::size_t i) const                       { return first[i]; }
+    };
+
+private:
+    // Callables are perfectly forwarded from the public constructors into their storage, so that they are moved or copied exactly
+    // once, and so that move-only callables can be held by unique_any_function
+    template<class F> using enable_if_callable          = typename std::enable_if<std::is_class<typename std::decay<F>::type>::value && !std::is_base_of<any_function, typename std::decay<F>::type>::value>::type;
+public:
+                                                        any_function()                                          : ops(), invoker(&empty_thunk), sig(empty_signature()) {}
+                                                        any_function(std::nullptr_t)                            : ops(), invoker(&empty_thunk), sig(empty_signature()) {}
+    template<class R, class... A>                       any_function(R (*p)(A...))                              : any_function(std::allocator_arg, default_resource(), p) {}
+    template<class F, class = enable_if_callable<F>>    any_function(F && f)                                    : any_function(std::allocator_arg, default_resource(), std::forward<F>(f)) {}
+                                                        any_function(const any_function & r)                    : any_function(std::allocator_arg, default_resource(), r) {}
+
+    // Allocator-extended constructors, which obtain any heap storage for the callable from m
+    template<class R, class... A>                       any_function(std::allocator_arg_t, memory_resource * m, R (*p)(A...)) : any_function(m, p, std::true_type{}, tag<R>{}, tag<A...>{}, build_indices<sizeof...(A)>{}) {}
+    template<class F, class = enable_if_callable<F>>    any_function(std::allocator_arg_t, memory_resource * m, F && f) : any_function(m, std::forward<F>(f), &std::decay<F>::type::operator()) { static_assert(std::is_copy_constructible<typename std::decay<F>::type>::value, "any_function requires a copyable callable, use unique_any_function for move-only callables"); }
+                                                        any_function(std::allocator_arg_t, memory_resource * m, const any_function & r) : ops(r.ops), invoker(r.invoker), sig(r.sig) { if(ops) ops->copy(r.storage, storage, m); }
+
+                                                        any_function(any_function && r) noexcept                : ops(r.ops), invoker(r.invoker), sig(r.sig) { if(ops) ops->move(r.storage, storage); r.ops = nullptr; r.invoker = &empty_thunk; r.sig = empty_signature(); }
+                                                        ~any_function()                                         { if(ops) ops->destroy(storage); }
+    any_function &                                      operator = (const any_function & r)                     { return *this = any_function(r); }
+    any_function &                                      operator = (any_function && r) noexcept                 { if(this != &r) { this->~any_function(); new(this) any_function(std::move(r)); } return *this; }
+
+    explicit                                            operator bool() const                                   { return ops != nullptr; }
+    type_list                                           get_parameter_types() const                             { return {sig->parameter_types, sig->parameter_types + sig->parameter_count}; }
+    const type &                                        get_result_type() const                                 { return sig->result_type; }
+
+    // 64-bit hash of the names and qualifiers of the result and parameter types, computed once per signature. Fingerprints are
+    // stable across runs, but distinct types may share a name, such as types in anonymous namespaces of different translation
+    // units, so equal fingerprints do not prove equal signatures. An empty any_function has a fingerprint of zero.
+    std::uint64_t                                       get_signature_fingerprint() const                       { return sig->fingerprint; }
+    template<class F> static std::uint64_t              signature_fingerprint()                                 { return signature_of(static_cast<F *>(nullptr))->fingerprint; }
+
+    // Exact test of the signature, as in has_signature<int(int)>(), by comparing the addresses of the interned signatures
+    template<class F> bool                              has_signature() const                                   { return sig == signature_of(static_cast<F *>(nullptr)); }
+
+    // Typed pack of pointers to the arguments of a call to a function with parameters A..., which can be passed to invoke(...) in
+    // place of an array of void pointers. Value parameters bind to const references, reference parameters to references of the
+    // same kind. The arguments must outlive the call.
+    template<class... A> class arguments
+    {
+        template<class T> struct param                  { typedef const T & type; };
+        template<class T> struct param<T &>             { typedef T & type; };
+        template<class T> struct param<T &&>            { typedef T && type; };
+        template<class T> static void *                 address(T & x)                                          { return const_cast<void *>(static_cast<const volatile void *>(std::addressof(x))); }
+        void *                                          pointers[sizeof...(A) + 1];
+    public:
+                                                        arguments(typename param<A>::type... a)                 : pointers{address(a)..., nullptr} {}
+        void * const *                                  data() const                                            { return pointers; }
+    };
+
+    // Checked invocation, which compares the argument types against the parameter types of the callable before calling it,
+    // throwing std::invalid_argument on a mismatch. The parameter types of every signature are interned, so this compares one pointer.
+    template<class... A> result                         invoke(const arguments<A...> & args) const              { return invoke(default_resource(), args); }
+    template<class... A> result                         invoke(memory_resource * m, const arguments<A...> & args) const { check_arguments(sig, args, "any_function::invoke: argument type mismatch"); return invoke(m, args.data()); }
+    template<class... A> void                           invoke_into(const type & out_type, void * out, const arguments<A...> & args) const { check_arguments(sig, args, "any_function::invoke_into: argument type mismatch"); invoke_into(out_type, out, args.data()); }
+
+    result                                              invoke(void * const args[]) const                       { return invoke(default_resource(), args); }
     result                                              invoke(std::initializer_list<void *> args) const        { return invoke(args.begin()); }
+    result                                              invoke(memory_resource * m, void * const args[]) const { return invoke_with(sig, invoker, &storage, m, args); }
+    result                                              invoke(memory_resource * m, std::initializer_list<void *> args) const { return invoke(m, args.begin()); }
+
+    // Constructs the return value directly in caller-provided storage, bypassing result. out_type must match get_result_type(). For
+    // non-reference result types, out must point to suitably aligned, uninitialized storage for an object of that type, which the
+    // caller is responsible for destroying. For reference result types, a pointer to the referent is written to out. For void, out
+    // is ignored.
+    void                                                invoke_into(const type & out_type, void * out, void * const args[]) const { if(out_type != sig->result_type) throw std::invalid_argument("any_function::invoke_into: result type mismatch"); invoker(&storage, args, out); }
+    void                                                invoke_into(const type & out_type, void * out, std::initializer_list<void *> args) const { invoke_into(out_type, out, args.begin()); }
+
+    // Invokes the callable count times over columns of arguments and results. Argument i of call n is read from args[i][n], and the
+    // return value of call n is constructed at out[n], following the same conventions as invoke_into(...).
+    void                                                invoke_batch(const type & out_type, const column & out, const column args[], std::size_t count) const { if(!ops) throw std::bad_function_call(); if(out_type != sig->result_type) throw std::invalid_argument("any_function::invoke_batch: result type mismatch"); ops->batch(&storage, out, args, count); }
+    void                                                invoke_batch(const type & out_type, const column & out, std::initializer_list<column> args, std::size_t count) const { invoke_batch(out_type, out, args.begin(), count); }
+
+    // invoke_parallel(...) does not start a thread for fewer rows than this
+    static const std::size_t                            min_rows_per_thread = 4096;
+
+    // True if the callable is a function pointer or an object with a const operator(), which are assumed to be safe to invoke from
+    // several threads at once. Mutable function objects and std::function objects, which may wrap mutable state, are not.
+    bool                                                is_const_invocable() const                              { return ops && ops->is_const_invocable; }
+
+    // Like invoke_batch(...), but splits the rows across up to thread_count threads (by default, one per hardware thread). Callables
+    // which are not const invocable are invoked serially on the calling thread instead. If calls throw, one of the exceptions is
+    // rethrown after all threads have finished.
+    void                                                invoke_parallel(const type & out_type, const column & out, const column args[], std::size_t count, unsigned thread_count = 0) const
+    {
+        if(!ops) throw std::bad_function_call();
+        if(out_type != sig->result_type) throw std::invalid_argument("any_function::invoke_parallel: result type mismatch");
+        if(thread_count == 0) thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+        const std::size_t chunks = ops->is_const_invocable ? std::min<std::size_t>(thread_count, (count + min_rows_per_thread - 1) / min_rows_per_thread) : 1;
+        if(chunks <= 1) return ops->batch(&storage, out, args, count);
+
+        const std::size_t n = sig->parameter_count;
+        std::vector<column> chunk_args(chunks * n);
+        std::vector<std::exception_ptr> errors(chunks);
+        auto run_chunk = [&](std::size_t c)
+        {
+            const std::size_t first = count * c / chunks, last = count * (c+1) / chunks;
+            for(std::size_t i=0; i<n; ++i) chunk_args[c*n+i] = {args[i][first], args[i].stride};
+            try { ops->batch(&storage, {out.data ? out[first] : nullptr, out.stride}, chunk_args.data() + c*n, last - first); }
+            catch(...) { errors[c] = std::current_exception(); }
+        };
+        std::vector<std::thread> threads;
+        threads.reserve(chunks - 1);
+        for(std::size_t c=1; c<chunks; ++c)
+        {
+            try { threads.emplace_back(run_chunk, c); }
+            catch(const std::system_error &) { run_chunk(c); }
+        }
+        run_chunk(0);
+        for(auto & t : threads) t.join();
+        for(auto & e : errors) if(e) std::rethrow_exception(e);
+    }
+    void                                                invoke_parallel(const type & out_type, const column & out, std::initializer_list<column> args, std::size_t count, unsigned thread_count = 0) const { invoke_parallel(out_type, out, args.begin(), count, thread_count); }
+
+    // Packed arguments are laid out back to back in parameter order, each as the bytes of its unqualified type with no padding, as
+    // they might arrive in a message. Every parameter type must be trivially copyable, and taken by value, by const reference or by
+    // r-value reference. Arguments which are suitably aligned within data are passed to the callable in place, and the rest, along
+    // with those taken by r-value reference, are copied to the stack first. size must equal get_packed_size().
+    bool                                                is_packable() const                                     { return ops && ops->packed; }
+    std::size_t                                         get_packed_size() const                                 { return sig->packed_size; }
+    result                                              invoke_packed(const void * data, std::size_t size) const { return invoke_packed(default_resource(), data, size); }
+    result                                              invoke_packed(memory_resource * m, const void * data, std::size_t size) const { const packed_invoker_type p = check_packed(ops, sig, size); return result::emplace(sig->result_ops, m, [&](void * out) { p(&storage, static_cast<const char *>(data), out); }); }
+    void                                                invoke_packed_into(const type & out_type, void * out, const void * data, std::size_t size) const { if(out_type != sig->result_type) throw std::invalid_argument("any_function::invoke_packed_into: result type mismatch"); check_packed(ops, sig, size)(&storage, static_cast<const char *>(data), out); }
+
+    // Invokes the callable and serializes its return value into out, which has room for capacity bytes, with any_function_serializer<T>
+    // and without constructing a result. Reference results serialize their referent, and void results write nothing. Returns the number
+    // of bytes written. Throws std::invalid_argument if the result type has no serializer, and std::length_error if it does not fit.
+    bool                                                is_result_serializable() const                          { return sig->serialize != nullptr; }
+    std::size_t                                         invoke_serialized(void * out, std::size_t capacity, void * const args[]) const { const call_context c = {invoker, &storage, args}; return check_serialize(ops, sig)(&produce_call, &c, out, capacity); }
+    std::size_t                                         invoke_serialized(void * out, std::size_t capacity, std::initializer_list<void *> args) const { return invoke_serialized(out, capacity, args.begin()); }
+    std::size_t                                         invoke_packed_serialized(void * out, std::size_t capacity, const void * data, std::size_t size) const { const packed_context c = {check_packed(ops, sig, size), &storage, static_cast<const char *>(data)}; return check_serialize(ops, sig)(&produce_packed, &c, out, capacity); }
+
+    // Binds copies of args, which must match the parameter types up to qualifiers, to a copy of this any_function (see bound_call)
+    class bound_call;
+    template<class... A> bound_call                     bind(A &&... args) const &;
+    template<class... A> bound_call                     bind(A &&... args) &&;
+
+#ifdef ANY_FUNCTION_COUNT_ALLOCATIONS
+    struct allocation_counters                          { std::size_t allocations, deallocations, bytes_allocated; };
+    static allocation_counters &                        get_allocation_counters()                               { static thread_local allocation_counters counters {}; return counters; }
+#endif
+
+    // Every heap allocation made by any_function, any_function::result and the companion headers goes through these, so that all
+    // of them are counted by get_allocation_counters()
+#ifdef ANY_FUNCTION_COUNT_ALLOCATIONS
+    static void *                                       allocate(memory_resource * m, std::size_t size, std::size_t alignment) { auto & c = get_allocation_counters(); ++c.allocations; c.bytes_allocated += size; return m->allocate(size, alignment); }
+    static void                                         deallocate(memory_resource * m, void * p, std::size_t size, std::size_t alignment) { ++get_allocation_counters().deallocations; m->deallocate(p, size, alignment); }
+#else
+    static void *                                       allocate(memory_resource * m, std::size_t size, std::size_t alignment) { return m->allocate(size, alignment); }
+    static void                                         deallocate(memory_resource * m, void * p, std::size_t size, std::size_t alignment) { m->deallocate(p, size, alignment); }
+#endif
 
 private:
     template<class... T> struct                         tag                                                     {};
@@ -117,16 +429,393 @@ private:
     template<class T> static T                          get(void * arg, tag<T>   )                              { return           *reinterpret_cast<T *>(arg);  }
     template<class T> static T &                        get(void * arg, tag<T &> )                              { return           *reinterpret_cast<T *>(arg);  }
     template<class T> static T &&                       get(void * arg, tag<T &&>)                              { return std::move(*reinterpret_cast<T *>(arg)); }
-    template<class F, class R, class... A, size_t... I> any_function(F f, tag<R   >, tag<A...>, indices<I...>)  : parameter_types({type::capture<A>()...}), result_type(type::capture<R   >()) { func = [f](void * const args[]) mutable { return result::capture<R>(f(get(args[I], tag<A>{})...));          }; }
-    template<class F,          class... A, size_t... I> any_function(F f, tag<void>, tag<A...>, indices<I...>)  : parameter_types({type::capture<A>()...}), result_type(type::capture<void>()) { func = [f](void * const args[]) mutable { return                    f(get(args[I], tag<A>{})...), result{}; }; }
-    template<class F, class R                         > any_function(F f, tag<R   >, tag<    >, indices<    >)  : parameter_types({                     }), result_type(type::capture<R   >()) { func = [f](void * const args[]) mutable { return result::capture<R>(f(                         ));          }; }
-    template<class F                                  > any_function(F f, tag<void>, tag<    >, indices<    >)  : parameter_types({                     }), result_type(type::capture<void>()) { func = [f](void * const args[]) mutable { return                    f(                         ), result{}; }; }
-    template<class F, class R, class... A             > any_function(F f, R (F::*p)(A...)      )                : any_function(f, tag<R>{}, tag<A...>{}, build_indices<sizeof...(A)>{}) {}
-    template<class F, class R, class... A             > any_function(F f, R (F::*p)(A...) const)                : any_function(f, tag<R>{}, tag<A...>{}, build_indices<sizeof...(A)>{}) {}
-
-    std::function<result(void * const *)>               func;
-    std::vector<type>                                   parameter_types;
-    type                                                result_type;
+
+    struct default_memory_resource : memory_resource
+    {
+        void *                                          allocate(std::size_t size, std::size_t alignment)       { return ANY_FUNCTION_ALLOCATE(size, alignment); }
+        void                                            deallocate(void * p, std::size_t size, std::size_t alignment) { ANY_FUNCTION_DEALLOCATE(p, size, alignment); }
+    };
+
+    // Plain operator new only aligns storage for fundamental types. Without the aligned operator new, over-aligned blocks are placed
+    // within a larger block, with the address of the larger block stored just before them.
+    static bool                                         is_over_aligned(std::size_t alignment)                  { return alignment > alignof(std::max_align_t); }
+#ifdef __cpp_aligned_new
+    static void *                                       default_allocate(std::size_t size, std::size_t alignment) { return is_over_aligned(alignment) ? ::operator new(size, std::align_val_t(alignment)) : ::operator new(size); }
+    static void                                         default_deallocate(void * p, std::size_t, std::size_t alignment) { if(is_over_aligned(alignment)) ::operator delete(p, std::align_val_t(alignment)); else ::operator delete(p); }
+#else
+    static void *                                       default_allocate(std::size_t size, std::size_t alignment)
+    {
+        if(!is_over_aligned(alignment)) return ::operator new(size);
+        char * b = static_cast<char *>(::operator new(size + alignment + sizeof(void *)));
+        char * p = b + ((reinterpret_cast<std::uintptr_t>(b) + sizeof(void *) + alignment - 1) / alignment * alignment - reinterpret_cast<std::uintptr_t>(b));
+        reinterpret_cast<void **>(p)[-1] = b;
+        return p;
+    }
+    static void                                         default_deallocate(void * p, std::size_t, std::size_t alignment) { ::operator delete(is_over_aligned(alignment) ? reinterpret_cast<void **>(p)[-1] : p); }
+#endif
+
+    // Heap blocks hold a pointer to the memory_resource they were allocated from, followed by an object of type T
+    template<class T> struct heap_block
+    {
+        static std::size_t                              offset()                                                { return (sizeof(memory_resource *) + alignof(T) - 1) / alignof(T) * alignof(T); }
+        static std::size_t                              alignment()                                             { return alignof(T) > alignof(memory_resource *) ? alignof(T) : alignof(memory_resource *); }
+        static void *                                   allocate(memory_resource * m)                           { char * b = (char *)any_function::allocate(m, offset() + sizeof(T), alignment()); *(memory_resource **)b = m; return b + offset(); }
+        static void                                     deallocate(void * p)                                    { char * b = (char *)p - offset(); any_function::deallocate(*(memory_resource **)b, b, offset() + sizeof(T), alignment()); }
+    };
+
+    // Shared blocks additionally hold a count of the callables which refer to the object of type T
+    template<class T> struct shared_block
+    {
+        struct header                                   { memory_resource * m; std::atomic<std::size_t> refs; header(memory_resource * m) : m(m), refs(1) {} };
+        static std::size_t                              offset()                                                { return (sizeof(header) + alignof(T) - 1) / alignof(T) * alignof(T); }
+        static std::size_t                              alignment()                                             { return alignof(T) > alignof(header) ? alignof(T) : alignof(header); }
+        static header &                                 get_header(void * p)                                    { return *reinterpret_cast<header *>((char *)p - offset()); }
+        static void *                                   allocate(memory_resource * m)                           { char * b = (char *)any_function::allocate(m, offset() + sizeof(T), alignment()); new(b) header(m); return b + offset(); }
+        static void                                     deallocate(void * p)                                    { header & h = get_header(p); memory_resource * m = h.m; h.~header(); any_function::deallocate(m, &h, offset() + sizeof(T), alignment()); }
+        static void                                     acquire(void * p)                                       { get_header(p).refs.fetch_add(1, std::memory_order_relaxed); }
+        static bool                                     release(void * p)                                       { return get_header(p).refs.fetch_sub(1, std::memory_order_acq_rel) == 1; }
+    };
+
+    // Signatures are compile-time constants, so every any_function with the same signature shares a single static description of it.
+    // parameters points to the signature with the same parameter types and a void result, which identifies the parameter types.
+    struct signature
+    {
+        type                                            result_type;
+        const type *                                    parameter_types;
+        std::size_t                                     parameter_count;
+        const result::ops *                             result_ops;
+        std::uint64_t                                   fingerprint;
+        const signature *                               parameters;
+        std::size_t                                     packed_size;
+        std::size_t                                     (*serialize)(void (*produce)(const void * context, void * out), const void * context, void * out, std::size_t capacity);
+    };
+    static std::uint64_t                                fingerprint_of(std::uint64_t h, const type * params, std::size_t n) { for(std::size_t i=0; i<n; ++i) h = params[i].fingerprint(h); return h; }
+    template<class R, class... A> static const signature * signature_of() { static const type params[] = {type::capture<A>()..., type{}}; static const signature s = {type::capture<R>(), params, sizeof...(A), result::table<R>(std::is_void<R>{}), fingerprint_of(type::capture<R>().fingerprint(), params, sizeof...(A)), std::is_void<R>::value ? &s : signature_of<void, A...>(), packed_size_of(tag<A...>{}), serialize_op<R>(is_serializable<R>{})}; return &s; }
+    template<class R, class... A> static const signature * signature_of(R (*)(A...)) { return signature_of<R, A...>(); }
+    template<class... A> static void                    check_arguments(const signature * sig, const arguments<A...> &, const char * what) { if(sig->parameters && sig->parameters != signature_of<void, A...>()) throw std::invalid_argument(what); }
+    static const signature *                            empty_signature()                                       { static const signature s = {type{}, nullptr, 0, nullptr, 0, nullptr, 0, nullptr}; return &s; }
+
+    // Callables which fit in ANY_FUNCTION_INLINE_SIZE bytes (and are nothrow movable) are stored inline, everything else lives on the heap
+    typedef typename std::aligned_storage<ANY_FUNCTION_INLINE_SIZE, alignof(void *)>::type storage_type;
+    typedef void (*                                     invoker_type)(void * storage, void * const args[], void * out);
+    typedef void (*                                     batch_invoker_type)(void * storage, const column & out, const column args[], std::size_t count);
+    typedef void (*                                     packed_invoker_type)(void * storage, const char * data, void * out);
+    struct callable_ops
+    {
+        void                                            (*copy)(const storage_type & from, storage_type & to, memory_resource * m);
+        void                                            (*move)(storage_type & from, storage_type & to);
+        void                                            (*destroy)(storage_type & s);
+        batch_invoker_type                              batch;
+        packed_invoker_type                             packed;
+        bool                                            is_const_invocable;
+    };
+    template<class C> static decltype(&C::copy)         copy_op(std::true_type)                                 { return &C::copy; }
+    template<class C> static decltype(&C::copy)         copy_op(std::false_type)                                { return nullptr; }
+    template<class C, class T, bool IsConst> static const callable_ops * ops_table() { static const callable_ops t = {copy_op<C>(std::is_copy_constructible<typename C::callable_type>{}), &C::move, &C::destroy, &T::call_batch, packed_op<T>(typename T::is_packable{}), IsConst}; return &t; }
+    template<class T> static packed_invoker_type        packed_op(std::true_type)                               { return &T::call_packed; }
+    template<class T> static packed_invoker_type        packed_op(std::false_type)                              { return nullptr; }
+    template<class F> struct fits_storage               : std::integral_constant<bool, sizeof(F) <= sizeof(storage_type) && alignof(F) <= alignof(storage_type) && std::is_nothrow_move_constructible<F>::value> {};
+    template<class F, bool Inline = fits_storage<F>::value, bool Mutable = false> struct callable
+    {
+        typedef F                                       callable_type;
+        static F &                                      get(void * s)                                           { return *reinterpret_cast<F *>(s); }
+        template<class V> static void                   construct(storage_type & s, memory_resource *, V && v) { new(&s) F(std::forward<V>(v)); }
+        static void                                     copy(const storage_type & from, storage_type & to, memory_resource *) { new(&to) F(get((void *)&from)); }
+        static void                                     move(storage_type & from, storage_type & to)            { new(&to) F(std::move(get(&from))); destroy(from); }
+        static void                                     destroy(storage_type & s)                               { get(&s).~F(); }
+    };
+    template<class F, bool Mutable> struct callable<F, false, Mutable>
+    {
+        typedef F                                       callable_type;
+        static F &                                      get(void * s)                                           { return **reinterpret_cast<F **>(s); }
+        template<class V> static void                   construct(storage_type & s, memory_resource * m, V && v) { void * p = heap_block<F>::allocate(m); try { new(p) F(std::forward<V>(v)); } catch(...) { heap_block<F>::deallocate(p); throw; } *reinterpret_cast<F **>(&s) = (F *)p; }
+        static void                                     copy(const storage_type & from, storage_type & to, memory_resource * m) { construct(to, m, get((void *)&from)); }
+        static void                                     move(storage_type & from, storage_type & to)            { *reinterpret_cast<F **>(&to) = &get(&from); }
+        static void                                     destroy(storage_type & s)                               { get(&s).~F(); heap_block<F>::deallocate(&get(&s)); }
+    };
+#if ANY_FUNCTION_SHARE_HEAP_CALLABLES
+    // Copies made with the same memory_resource share a const invocable callable, which calls cannot modify, so that the callable
+    // is never written to once constructed and copies may be invoked from different threads
+    template<class F> struct callable<F, false, false>
+    {
+        typedef F                                       callable_type;
+        typedef shared_block<F>                         block;
+        static F *&                                     pointer(void * s)                                       { return *reinterpret_cast<F **>(s); }
+        static F &                                      get(void * s)                                           { return *pointer(s); }
+        template<class V> static F *                    create(memory_resource * m, V && v)                     { void * p = block::allocate(m); try { return new(p) F(std::forward<V>(v)); } catch(...) { block::deallocate(p); throw; } }
+        static void                                     release(F * p)                                          { if(block::release(p)) { p->~F(); block::deallocate(p); } }
+        template<class V> static void                   construct(storage_type & s, memory_resource * m, V && v) { pointer(&s) = create(m, std::forward<V>(v)); }
+        static void                                     copy(const storage_type & from, storage_type & to, memory_resource * m) { F * p = pointer((void *)&from); if(block::get_header(p).m == m) block::acquire(pointer(&to) = p); else construct(to, m, *p); }
+        static void                                     move(storage_type & from, storage_type & to)            { pointer(&to) = pointer(&from); }
+        static void                                     destroy(storage_type & s)                               { release(pointer(&s)); }
+    };
+#endif
+
+    // apply(f, args, out) unpacks the arguments args[0], args[1], ..., calls f, and constructs its return value in place at out. Reference
+    // return values are written as pointers to their referent.
+    template<class F, class R, class A, class I, bool IsRef = std::is_reference<R>::value> struct apply_call;
+    template<class F, class R, class... A, size_t... I> struct apply_call<F, R,    tag<A...>, indices<I...>, false> { template<class Args> static void apply(F & f, const Args & args, void * out) { new(out) R                         (f(get(args[I], tag<A>{})...)); } };
+    template<class F, class R, class... A, size_t... I> struct apply_call<F, R,    tag<A...>, indices<I...>, true > { template<class Args> static void apply(F & f, const Args & args, void * out) { result::holder<R>::construct(out, f(get(args[I], tag<A>{})...)); } };
+    template<class F,          class... A, size_t... I> struct apply_call<F, void, tag<A...>, indices<I...>, false> { template<class Args> static void apply(F & f, const Args & args, void *    ) {                                 f(get(args[I], tag<A>{})...);  } };
+    template<class F, class R                         > struct apply_call<F, R,    tag<    >, indices<    >, false> { template<class Args> static void apply(F & f, const Args &,      void * out) { new(out) R                         (f(                         )); } };
+    template<class F, class R                         > struct apply_call<F, R,    tag<    >, indices<    >, true > { template<class Args> static void apply(F & f, const Args &,      void * out) { result::holder<R>::construct(out, f(                         )); } };
+    template<class F                                  > struct apply_call<F, void, tag<    >, indices<    >, false> { template<class Args> static void apply(F & f, const Args &,      void *    ) {                                 f(                         );  } };
+
+    // Callables whose parameters can all be packed get a decoder alongside their thunk, which points the arguments at the packed
+    // data, or at aligned copies of it on its own stack, and calls the callable directly
+    template<class A> struct packed_arg
+    {
+        typedef typename std::remove_cv<typename std::remove_reference<A>::type>::type value_type;
+        typedef typename std::aligned_storage<sizeof(value_type), alignof(value_type)>::type storage_type;
+        static const bool                               is_packable = ANY_FUNCTION_IS_TRIVIALLY_COPYABLE(value_type) && (!std::is_lvalue_reference<A>::value || std::is_const<typename std::remove_reference<A>::type>::value);
+        static void *                                   decode(const char *& p, storage_type & s)
+        {
+            const char * q = p; p += sizeof(value_type);
+            if(!std::is_rvalue_reference<A>::value && reinterpret_cast<std::uintptr_t>(q) % alignof(value_type) == 0) return const_cast<char *>(q);
+            std::memcpy(&s, q, sizeof(value_type)); return &s;
+        }
+    };
+    template<bool... B> struct bools                    {};
+    template<bool... B> struct all_of                   : std::is_same<bools<B..., true>, bools<true, B...>> {};
+    template<class... A> static std::size_t             packed_size_of(tag<A...>)                               { std::size_t n = 0; int expand[] = {0, (n += sizeof(typename packed_arg<A>::value_type), 0)...}; static_cast<void>(expand); return n; }
+    template<class A, class I> struct packed_call;
+    template<class... A, size_t... I> struct packed_call<tag<A...>, indices<I...>>
+    {
+        typedef all_of<packed_arg<A>::is_packable...>   is_packable;
+        template<class Impl, class F> static void       call(F & f, const char * data, void * out) { std::tuple<typename packed_arg<A>::storage_type...> scratch; void * args[] = {packed_arg<A>::decode(data, std::get<I>(scratch))..., nullptr}; static_cast<void>(data); Impl::apply(f, args, out); }
+    };
+
+    // Thunks call the stored callable directly, so that invocation is a single indirect call, and batch invocation pays for that
+    // indirect call once per batch, with a loop the compiler can see through. When every column is densely packed, the loop uses
+    // compile-time strides, so that simple callables can be vectorized.
+    struct column_row                                   { const column * columns; std::size_t row; void * operator [] (std::size_t i) const { return columns[i][row]; } };
+    template<class A> struct dense_row;
+    template<class... A> struct dense_row<tag<A...>>
+    {
+        const column *                                  columns;
+        std::size_t                                     row;
+        static std::size_t                              stride(std::size_t i)                                   { static const std::size_t strides[] = {sizeof(typename std::remove_reference<A>::type)..., 0}; return strides[i]; }
+        static bool                                     is_dense(const column args[])                           { for(std::size_t i=0; i<sizeof...(A); ++i) if(args[i].stride != static_cast<std::ptrdiff_t>(stride(i))) return false; return true; }
+        void *                                          operator [] (std::size_t i) const                       { return static_cast<char *>(columns[i].data) + row * stride(i); }
+    };
+    template<class T> static std::size_t                result_stride(tag<T>)                                   { return sizeof(typename result::holder<T>::value_type); }
+    static std::size_t                                  result_stride(tag<void>)                                { return 0; }
+    template<class C, class R, class A, class I> struct thunk
+    {
+        typedef apply_call<typename C::callable_type, R, A, I> impl;
+        typedef typename packed_call<A, I>::is_packable is_packable;
+        static void                                     call(void * s, void * const args[], void * out)         { impl::apply(C::get(s), args, out); }
+        static void                                     call_packed(void * s, const char * data, void * out)    { packed_call<A, I>::template call<impl>(C::get(s), data, out); }
+        static void                                     call_batch(void * s, const column & out, const column args[], std::size_t count)
+        {
+            auto & f = C::get(s);
+            const std::size_t out_stride = result_stride(tag<R>{});
+            if((out_stride == 0 || out.stride == static_cast<std::ptrdiff_t>(out_stride)) && dense_row<A>::is_dense(args)) for(std::size_t i=0; i<count; ++i) impl::apply(f, dense_row<A>{args, i}, static_cast<char *>(out.data) + i * out_stride);
+            else for(std::size_t i=0; i<count; ++i) impl::apply(f, column_row{args, i}, out[i]);
+        }
+    };
+    static void                                         empty_thunk(void *, void * const *, void *)             { throw std::bad_function_call(); }
+
+    static packed_invoker_type                          check_packed(const callable_ops * ops, const signature * sig, std::size_t size)
+    {
+        if(!ops) throw std::bad_function_call();
+        if(!ops->packed) throw std::invalid_argument("any_function::invoke_packed: parameter types cannot be packed");
+        if(size != sig->packed_size) throw std::invalid_argument("any_function::invoke_packed: packed argument size mismatch");
+        return ops->packed;
+    }
+    // Return values are constructed on the stack by produce(context, out), then serialized, then destroyed
+    template<class R> struct serializer_of              { typedef any_function_serializer<typename std::remove_cv<typename std::remove_reference<R>::type>::type> type; };
+    template<class S> static std::true_type             has_serialize(decltype(&S::serialize));
+    template<class S> static std::false_type            has_serialize(...);
+    template<class R> struct is_serializable            : std::integral_constant<bool, std::is_void<R>::value || (!std::is_volatile<typename std::remove_reference<R>::type>::value && decltype(has_serialize<typename serializer_of<R>::type>(nullptr))::value)> {};
+    template<class R> static std::size_t                serialize_result(void (*produce)(const void *, void *), const void * context, void * out, std::size_t capacity, std::false_type)
+    {
+        typedef typename result::holder<R>::value_type value_type;
+        typename std::aligned_storage<sizeof(value_type), alignof(value_type)>::type storage;
+        produce(context, &storage);
+        struct destroy { value_type & v; ~destroy() { v.~value_type(); } } guard {*reinterpret_cast<value_type *>(&storage)};
+        return serializer_of<R>::type::serialize(*static_cast<const typename std::remove_reference<R>::type *>(result::holder<R>::address(guard.v)), out, capacity);
+    }
+    template<class R> static std::size_t                serialize_result(void (*produce)(const void *, void *), const void * context, void *, std::size_t, std::true_type) { produce(context, nullptr); return 0; }
+    template<class R> static std::size_t                serialize_result(void (*produce)(const void *, void *), const void * context, void * out, std::size_t capacity) { return serialize_result<R>(produce, context, out, capacity, std::is_void<R>{}); }
+    template<class R> static decltype(signature::serialize) serialize_op(std::true_type)                        { return &serialize_result<R>; }
+    template<class R> static decltype(signature::serialize) serialize_op(std::false_type)                       { return nullptr; }
+    struct call_context                                 { invoker_type invoker; void * storage; void * const * args; };
+    struct packed_context                               { packed_invoker_type invoker; void * storage; const char * data; };
+    static void                                         produce_call(const void * c, void * out)                { auto & x = *static_cast<const call_context *>(c); x.invoker(x.storage, x.args, out); }
+    static void                                         produce_packed(const void * c, void * out)              { auto & x = *static_cast<const packed_context *>(c); x.invoker(x.storage, x.data, out); }
+    static decltype(signature::serialize)               check_serialize(const callable_ops * ops, const signature * sig) { if(!ops) throw std::bad_function_call(); if(!sig->serialize) throw std::invalid_argument("any_function::invoke_serialized: result type has no serializer"); return sig->serialize; }
+    static result                                       invoke_with(const signature * sig, invoker_type invoker, void * s, memory_resource * m, void * const args[]) { return result::emplace(sig->result_ops, m, [&](void * out) { invoker(s, args, out); }); }
+
+    // Callables with a const operator() are const invocable, unless they are std::function objects
+    template<class F> struct is_std_function            : std::false_type {};
+    template<class F> struct is_std_function<std::function<F>> : std::true_type {};
+    template<class F, bool C, class R, class... A, size_t... I> any_function(memory_resource * m, F && f, std::integral_constant<bool, C>, tag<R>, tag<A...>, indices<I...>) : any_function(m, std::forward<F>(f), std::integral_constant<bool, C>{}, tag<callable<typename std::decay<F>::type, fits_storage<typename std::decay<F>::type>::value, !C>>{}, tag<R>{}, tag<A...>{}, indices<I...>{}) {}
+    template<class F, bool C, class D, class R, class... A, size_t... I> any_function(memory_resource * m, F && f, std::integral_constant<bool, C>, tag<D>, tag<R>, tag<A...>, indices<I...>) : ops(ops_table<D, thunk<D, R, tag<A...>, indices<I...>>, C>()), invoker(&thunk<D, R, tag<A...>, indices<I...>>::call), sig(signature_of<R, A...>()) { D::construct(storage, m, std::forward<F>(f)); }
+    template<class F, class G, class R, class... A    > any_function(memory_resource * m, F && f, R (G::*)(A...)      ) : any_function(m, std::forward<F>(f), std::false_type{}, tag<R>{}, tag<A...>{}, build_indices<sizeof...(A)>{}) {}
+    template<class F, class G, class R, class... A    > any_function(memory_resource * m, F && f, R (G::*)(A...) const) : any_function(m, std::forward<F>(f), std::integral_constant<bool, !is_std_function<G>::value>{}, tag<R>{}, tag<A...>{}, build_indices<sizeof...(A)>{}) {}
+
+    mutable storage_type                                storage;
+    const callable_ops *                                ops;
+    invoker_type                                        invoker;
+    const signature *                                   sig;
+
+    friend class unique_any_function;
+    friend class any_function_ref;
 };
 
+// A call of an any_function with argument values bound to it, which can be invoked repeatedly, or moved to another thread and
+// invoked there. The arguments are held in a std::tuple, stored inline if it fits in ANY_FUNCTION_INLINE_SIZE bytes and on the
+// heap otherwise. Parameters taken by reference refer to the stored arguments, so r-value reference parameters move from them.
+class any_function::bound_call
+{
+    struct bound_ops
+    {
+        result                                          (*invoke)(const any_function & f, void * args, memory_resource * m);
+        void                                            (*invoke_into)(const any_function & f, void * args, void * out);
+        void                                            (*move)(storage_type & from, storage_type & to);
+        void                                            (*destroy)(storage_type & s);
+    };
+    template<class T, class C = callable<T>> struct bound
+    {
+        template<size_t... I> static void               unpack(void * args, void ** pointers, indices<I...>) { T & t = C::get(args); int expand[] = {0, (pointers[I] = std::addressof(std::get<I>(t)), 0)...}; static_cast<void>(expand); }
+        static result                                   invoke(const any_function & f, void * args, memory_resource * m) { void * p[std::tuple_size<T>::value + 1] = {}; unpack(args, p, build_indices<std::tuple_size<T>::value>{}); return invoke_with(f.sig, f.invoker, &f.storage, m, p); }
+        static void                                     invoke_into(const any_function & f, void * args, void * out) { void * p[std::tuple_size<T>::value + 1] = {}; unpack(args, p, build_indices<std::tuple_size<T>::value>{}); f.invoker(&f.storage, p, out); }
+        static const bound_ops *                        table()                                                 { static const bound_ops t = {&invoke, &invoke_into, &C::move, &C::destroy}; return &t; }
+    };
+
+    any_function                                        function;
+    const bound_ops *                                   ops;
+    mutable storage_type                                arguments;
+
+    template<class F, class... A>                       bound_call(tag<>, F && f, A &&... args)                 : function(std::forward<F>(f)), ops()
+    {
+        typedef std::tuple<typename std::decay<A>::type...> tuple_type;
+        const type expected[] = {type::capture<typename std::decay<A>::type>()..., type{}};
+        if(function.sig->parameter_count != sizeof...(A)) throw std::invalid_argument("any_function::bind: wrong number of arguments");
+        for(std::size_t i=0; i<sizeof...(A); ++i) if(function.sig->parameter_types[i].unqualified() != expected[i]) throw std::invalid_argument("any_function::bind: argument type mismatch");
+        callable<tuple_type>::construct(arguments, default_resource(), tuple_type(std::forward<A>(args)...));
+        ops = bound<tuple_type>::table();
+    }
+    friend struct any_function;
+public:
+                                                        bound_call()                                            : ops() {}
+                                                        bound_call(bound_call && r) noexcept                    : function(std::move(r.function)), ops(r.ops) { if(ops) ops->move(r.arguments, arguments); r.ops = nullptr; }
+                                                        ~bound_call()                                           { if(ops) ops->destroy(arguments); }
+    bound_call &                                        operator = (bound_call && r) noexcept                   { if(this != &r) { this->~bound_call(); new(this) bound_call(std::move(r)); } return *this; }
+
+    explicit                                            operator bool() const                                   { return ops != nullptr; }
+    const any_function &                                get_function() const                                    { return function; }
+    result                                              invoke() const                                          { return invoke(default_resource()); }
+    result                                              invoke(memory_resource * m) const                       { if(!ops) throw std::bad_function_call(); return ops->invoke(function, &arguments, m); }
+    void                                                invoke_into(const type & out_type, void * out) const    { if(!ops) throw std::bad_function_call(); if(out_type != function.sig->result_type) throw std::invalid_argument("any_function::bound_call::invoke_into: result type mismatch"); ops->invoke_into(function, &arguments, out); }
+};
+template<class... A> any_function::bound_call           any_function::bind(A &&... args) const &                { return bound_call(tag<>{}, *this, std::forward<A>(args)...); }
+template<class... A> any_function::bound_call           any_function::bind(A &&... args) &&                     { return bound_call(tag<>{}, std::move(*this), std::forward<A>(args)...); }
+
+// Move-only counterpart of any_function, which can hold callables that cannot be copied, such as lambdas which capture a
+// std::unique_ptr. Callables are perfectly forwarded into storage, so a callable passed as an r-value is moved exactly once.
+class unique_any_function : private any_function
+{
+public:
+    using any_function::type;
+    using any_function::type_list;
+    using any_function::result;
+    using any_function::column;
+    using any_function::memory_resource;
+    using any_function::arguments;
+    using any_function::min_rows_per_thread;
+
+                                                        unique_any_function()                                   {}
+                                                        unique_any_function(std::nullptr_t)                     {}
+    template<class R, class... A>                       unique_any_function(R (*p)(A...))                       : any_function(p) {}
+    template<class F, class = enable_if_callable<F>>    unique_any_function(F && f)                             : unique_any_function(std::allocator_arg, default_resource(), std::forward<F>(f)) {}
+                                                        unique_any_function(any_function && r) noexcept         : any_function(std::move(r)) {}
+    template<class R, class... A>                       unique_any_function(std::allocator_arg_t, memory_resource * m, R (*p)(A...)) : any_function(std::allocator_arg, m, p) {}
+    template<class F, class = enable_if_callable<F>>    unique_any_function(std::allocator_arg_t, memory_resource * m, F && f) : any_function(m, std::forward<F>(f), &std::decay<F>::type::operator()) {}
+                                                        unique_any_function(unique_any_function && r) noexcept  = default;
+                                                        unique_any_function(const unique_any_function &)        = delete;
+    unique_any_function &                               operator = (unique_any_function && r) noexcept          = default;
+    unique_any_function &                               operator = (const unique_any_function &)                = delete;
+
+    using any_function::operator bool;
+    using any_function::get_parameter_types;
+    using any_function::get_result_type;
+    using any_function::get_signature_fingerprint;
+    using any_function::has_signature;
+    using any_function::is_const_invocable;
+    using any_function::invoke;
+    using any_function::invoke_into;
+    using any_function::invoke_batch;
+    using any_function::invoke_parallel;
+    using any_function::is_packable;
+    using any_function::get_packed_size;
+    using any_function::invoke_packed;
+    using any_function::invoke_packed_into;
+    using any_function::is_result_serializable;
+    using any_function::invoke_serialized;
+    using any_function::invoke_packed_serialized;
+
+    friend class any_function_ref;
+};
+
+// Non-owning reference to a callable or any_function, invoked through the same protocol as any_function. An any_function_ref is
+// three pointers, is trivially copyable, and never allocates, but whatever it refers to must outlive it. Function pointers are
+// held by value.
+class any_function_ref
+{
+    typedef any_function::invoker_type                  invoker_type;
+    template<class... T> using tag                      = any_function::tag<T...>;
+    template<size_t... I> using indices                 = any_function::indices<I...>;
+public:
+    typedef any_function::type                          type;
+    typedef any_function::type_list                     type_list;
+    typedef any_function::result                        result;
+    typedef any_function::memory_resource               memory_resource;
+    template<class... A> using arguments                = any_function::arguments<A...>;
+
+                                                        any_function_ref()                                      : object(), invoker(&any_function::empty_thunk), sig(any_function::empty_signature()) {}
+                                                        any_function_ref(std::nullptr_t)                        : object(), invoker(&any_function::empty_thunk), sig(any_function::empty_signature()) {}
+                                                        any_function_ref(const any_function & f)                : object(&f.storage), invoker(f.invoker), sig(f.sig) {}
+                                                        any_function_ref(const unique_any_function & f)         : any_function_ref(static_cast<const any_function &>(f)) {}
+    template<class R, class... A>                       any_function_ref(R (*p)(A...))                           : any_function_ref(reinterpret_cast<void *>(p), tag<R (*)(A...)>{}, tag<R>{}, tag<A...>{}, any_function::build_indices<sizeof...(A)>{}) {}
+    template<class F, class D = typename std::decay<F>::type, class = typename std::enable_if<std::is_class<D>::value && !std::is_same<D, any_function_ref>::value && !std::is_base_of<any_function, D>::value>::type>
+                                                        any_function_ref(F && f)                                : any_function_ref(f, &D::operator()) {}
+
+    explicit                                            operator bool() const                                   { return invoker != &any_function::empty_thunk; }
+    type_list                                           get_parameter_types() const                             { return {sig->parameter_types, sig->parameter_types + sig->parameter_count}; }
+    const type &                                        get_result_type() const                                 { return sig->result_type; }
+    std::uint64_t                                       get_signature_fingerprint() const                       { return sig->fingerprint; }
+    template<class F> bool                              has_signature() const                                   { return sig == any_function::signature_of(static_cast<F *>(nullptr)); }
+
+    result                                              invoke(void * const args[]) const                       { return invoke(any_function::default_resource(), args); }
+    result                                              invoke(std::initializer_list<void *> args) const        { return invoke(args.begin()); }
+    result                                              invoke(memory_resource * m, void * const args[]) const { return any_function::invoke_with(sig, invoker, object, m, args); }
+    result                                              invoke(memory_resource * m, std::initializer_list<void *> args) const { return invoke(m, args.begin()); }
+    template<class... A> result                         invoke(const arguments<A...> & args) const              { any_function::check_arguments(sig, args, "any_function_ref::invoke: argument type mismatch"); return invoke(args.data()); }
+    void                                                invoke_into(const type & out_type, void * out, void * const args[]) const { if(out_type != sig->result_type) throw std::invalid_argument("any_function_ref::invoke_into: result type mismatch"); invoker(object, args, out); }
+    void                                                invoke_into(const type & out_type, void * out, std::initializer_list<void *> args) const { invoke_into(out_type, out, args.begin()); }
+private:
+    // Function objects are called through the same thunks as inline callables of an any_function, with object pointing at them
+    template<class F, class R, class... A, size_t... I> any_function_ref(F & f, tag<R>, tag<A...>, indices<I...>) : object(const_cast<void *>(static_cast<const volatile void *>(std::addressof(f)))), invoker(&any_function::thunk<any_function::callable<F, true>, R, tag<A...>, indices<I...>>::call), sig(any_function::signature_of<R, A...>()) {}
+    template<class F, class G, class R, class... A> any_function_ref(F & f, R (G::*)(A...)      ) : any_function_ref(f, tag<R>{}, tag<A...>{}, any_function::build_indices<sizeof...(A)>{}) {}
+    template<class F, class G, class R, class... A> any_function_ref(F & f, R (G::*)(A...) const) : any_function_ref(f, tag<R>{}, tag<A...>{}, any_function::build_indices<sizeof...(A)>{}) {}
+    // Function pointers are stored in object itself, and copied back out to be called
+    template<class P, class R, class... A, size_t... I> any_function_ref(void * p, tag<P>, tag<R>, tag<A...>, indices<I...>) : object(p), invoker(&call_function_pointer<P, R, tag<A...>, indices<I...>>), sig(any_function::signature_of<R, A...>()) {}
+    template<class P, class R, class A, class I> static void call_function_pointer(void * s, void * const args[], void * out) { P p = reinterpret_cast<P>(s); any_function::thunk<any_function::callable<P, true>, R, A, I>::call(&p, args, out); }
+
+    void *                                              object;
+    invoker_type                                        invoker;
+    const any_function::signature *                     sig;
+};
+
+// Hashes an any_function::type by its packed word, allowing types to be used as keys in unordered containers
+namespace std
+{
+    template<> struct hash<any_function::type>
+    {
+        std::size_t                                     operator() (const any_function::type & t) const         { return hash<std::uintptr_t>()(t.bits); }
+    };
+}
+
 #endif
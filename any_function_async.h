@@ -0,0 +1,138 @@
+// any_function_async - Asynchronous invocation of any_function on an executor
+//
+// invoke_async(executor, call) hands a bound call to an executor and returns an any_function_future for its result. An executor
+// is any object with a member function execute(f), which arranges for the nullary function object f to be called once, on some
+// thread. If the executor destroys f without calling it, the future reports std::future_error(std::future_errc::broken_promise).
+// The call, its result and the state shared with the future live in a single heap allocation, made from
+// any_function::default_resource() and counted with the allocations of any_function itself. When compiled as C++20 with coroutine
+// support, futures can also be co_awaited.
+//
+// This is free and unencumbered software released into the public domain, under the same terms as any_function.h.
+
+#pragma once
+#ifndef ANY_FUNCTION_ASYNC_H
+#define ANY_FUNCTION_ASYNC_H
+
+#include "any_function.h"
+#include <atomic>               // For std::atomic<T>
+#include <condition_variable>   // For std::condition_variable
+#include <future>               // For std::future_error
+#include <mutex>                // For std::mutex
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>            // For std::coroutine_handle<P>
+#define ANY_FUNCTION_HAS_COROUTINES
+#endif
+#endif
+
+// Executor which calls functions immediately, on the thread which submits them
+struct any_function_inline_executor
+{
+    template<class F> void                              execute(F && f) const                                   { f(); }
+};
+
+class any_function_future
+{
+    // Shared between the future and the function handed to the executor, and destroyed when both have let go of it
+    class task
+    {
+        enum : int                                      { pending, awaited, done };
+        std::atomic<int>                                refs, runners, state;
+        any_function::bound_call                        call;
+        any_function::result                            value;
+        std::exception_ptr                              error;
+        std::mutex                                      mutex;
+        std::condition_variable                         finished;
+        void *                                          continuation;
+        void                                            (*resume)(void * continuation);
+    public:
+                                                        task(any_function::bound_call && call)                  : refs(1), runners(0), state(pending), call(std::move(call)), continuation(), resume() {}
+
+        static task *                                   create(any_function::bound_call && call) { void * p = any_function::allocate(any_function::default_resource(), sizeof(task), alignof(task)); try { return new(p) task(std::move(call)); } catch(...) { any_function::deallocate(any_function::default_resource(), p, sizeof(task), alignof(task)); throw; } }
+        void                                            acquire()                                               { refs.fetch_add(1, std::memory_order_relaxed); }
+        void                                            release()                                               { if(refs.fetch_sub(1, std::memory_order_acq_rel) == 1) { this->~task(); any_function::deallocate(any_function::default_resource(), this, sizeof(task), alignof(task)); } }
+
+        void                                            add_runner()                                            { runners.fetch_add(1, std::memory_order_relaxed); acquire(); }
+        void                                            remove_runner()                                         { if(runners.fetch_sub(1, std::memory_order_acq_rel) == 1 && !is_ready()) abandon(); release(); }
+
+        // Called on the executor. Stores the result, then wakes any waiting thread and resumes any awaiting coroutine.
+        void                                            run()
+        {
+            try { value = call.invoke(); } catch(...) { error = std::current_exception(); }
+            finish();
+        }
+        // Called when the executor has destroyed every runner without calling one, as std::packaged_task does when destroyed
+        void                                            abandon()
+        {
+            error = std::make_exception_ptr(std::future_error(std::future_errc::broken_promise));
+            finish();
+        }
+        void                                            finish()
+        {
+            call = any_function::bound_call();
+            int previous;
+            { std::lock_guard<std::mutex> lock(mutex); previous = state.exchange(done, std::memory_order_acq_rel); }
+            finished.notify_all();
+            if(previous == awaited) resume(continuation);
+        }
+        bool                                            is_ready() const                                        { return state.load(std::memory_order_acquire) == done; }
+        void                                            wait()                                                  { std::unique_lock<std::mutex> lock(mutex); finished.wait(lock, [this]() { return is_ready(); }); }
+        any_function::result                            get()                                                   { wait(); if(error) std::rethrow_exception(error); return std::move(value); }
+
+        // Returns false if the task has already finished, in which case the continuation will not be resumed
+        bool                                            await(void * c, void (*r)(void *))                      { continuation = c; resume = r; int expected = pending; return state.compare_exchange_strong(expected, awaited, std::memory_order_acq_rel); }
+    };
+
+    // Function object handed to the executor. Copyable, so that it can be held by std::function based executors.
+    struct runner
+    {
+        task *                                          t;
+                                                        runner(task * t)                                        : t(t) { t->add_runner(); }
+                                                        runner(const runner & r)                                : t(r.t) { t->add_runner(); }
+                                                        ~runner()                                               { t->remove_runner(); }
+        runner &                                        operator = (const runner &)                             = delete;
+        void                                            operator() () const                                     { t->run(); }
+    };
+
+    task *                                              t;
+                                                        any_function_future(task * t)                           : t(t) {}
+    template<class Executor> friend any_function_future invoke_async(Executor && executor, any_function::bound_call call);
+public:
+                                                        any_function_future()                                   : t() {}
+                                                        any_function_future(any_function_future && r) noexcept  : t(r.t) { r.t = nullptr; }
+                                                        ~any_function_future()                                  { if(t) t->release(); }
+    any_function_future &                               operator = (any_function_future && r) noexcept          { std::swap(t, r.t); return *this; }
+
+    bool                                                valid() const                                           { return t != nullptr; }
+    bool                                                is_ready() const                                        { return t && t->is_ready(); }
+    void                                                wait() const                                            { t->wait(); }
+
+    // Waits for the call to finish and returns its result, or rethrows the exception it threw. The future is no longer valid.
+    any_function::result                                get()                                                   { any_function_future f(std::move(*this)); return f.t->get(); }
+
+#ifdef ANY_FUNCTION_HAS_COROUTINES
+    // Suspends the awaiting coroutine until the call has finished, and resumes it on the thread which ran the call
+    struct awaiter
+    {
+        any_function_future &                           future;
+        bool                                            await_ready() const                                     { return future.is_ready(); }
+        bool                                            await_suspend(std::coroutine_handle<> h)                { return future.t->await(h.address(), [](void * c) { std::coroutine_handle<>::from_address(c).resume(); }); }
+        any_function::result                            await_resume()                                          { return future.get(); }
+    };
+    awaiter                                             operator co_await() &                                   { return {*this}; }
+    awaiter                                             operator co_await() &&                                  { return {*this}; }
+#endif
+};
+
+// Submits call to executor, and returns a future for its result. If executor.execute(...) throws, the exception propagates.
+template<class Executor> any_function_future            invoke_async(Executor && executor, any_function::bound_call call)
+{
+    any_function_future future(any_function_future::task::create(std::move(call)));
+    executor.execute(any_function_future::runner(future.t));
+    return future;
+}
+
+// Binds args to f (see any_function::bind) and submits the bound call to executor
+template<class Executor, class... A> any_function_future invoke_async(Executor && executor, const any_function & f, A &&... args) { return invoke_async(std::forward<Executor>(executor), f.bind(std::forward<A>(args)...)); }
+
+#endif
@@ -0,0 +1,202 @@
+// any_function_executor - Work-stealing thread pool for any_function calls
+//
+// any_function_executor runs bound calls on a fixed set of worker threads. Calls submitted by a worker, such as those fanned out by
+// another call, go to the bottom of that worker's own deque, and idle workers steal from the top of the others' deques, so that
+// most calls never touch a shared lock. Calls submitted from other threads go through a single injection queue. Any executor
+// can be used with invoke_async(...) from any_function_async.h.
+//
+// This is free and unencumbered software released into the public domain, under the same terms as any_function.h.
+
+#pragma once
+#ifndef ANY_FUNCTION_EXECUTOR_H
+#define ANY_FUNCTION_EXECUTOR_H
+
+#include "any_function.h"
+#include <atomic>               // For std::atomic<T>
+#include <condition_variable>   // For std::condition_variable
+#include <deque>                // For std::deque<T>
+#include <mutex>                // For std::mutex
+
+class any_function_executor
+{
+    typedef any_function::bound_call task;
+    static task *                                       create(task && call)                                    { void * p = any_function::allocate(any_function::default_resource(), sizeof(task), alignof(task)); return new(p) task(std::move(call)); }
+    static void                                         destroy(task * t)                                       { t->~task(); any_function::deallocate(any_function::default_resource(), t, sizeof(task), alignof(task)); }
+
+    // Chase-Lev deque, as formulated for C11 atomics by Le, Pop, Cohen and Zappa Nardelli. Only the owning worker pushes and takes
+    // at the bottom, while any thread may steal from the top. Arrays which have been outgrown are kept until the deque is destroyed,
+    // as a thief may still be reading from them.
+    class work_deque
+    {
+        struct array
+        {
+            std::size_t                                 mask;
+            std::atomic<task *> *                       slots;
+            explicit                                    array(std::size_t size)                                 : mask(size - 1), slots(new std::atomic<task *>[size]) {}
+                                                        ~array()                                                { delete[] slots; }
+            task *                                      get(std::int64_t i) const                               { return slots[i & mask].load(std::memory_order_relaxed); }
+            void                                        put(std::int64_t i, task * t)                           { slots[i & mask].store(t, std::memory_order_relaxed); }
+        };
+        alignas(64) std::atomic<std::int64_t>           top;
+        alignas(64) std::atomic<std::int64_t>           bottom;
+        std::atomic<array *>                            current;
+        std::vector<std::unique_ptr<array>>             arrays;
+    public:
+                                                        work_deque()                                            : top(0), bottom(0) { arrays.emplace_back(new array(256)); current.store(arrays.back().get(), std::memory_order_relaxed); }
+
+        void                                            push(task * t)
+        {
+            const std::int64_t b = bottom.load(std::memory_order_relaxed), tp = top.load(std::memory_order_acquire);
+            array * a = current.load(std::memory_order_relaxed);
+            if(b - tp > static_cast<std::int64_t>(a->mask))
+            {
+                arrays.emplace_back(new array((a->mask + 1) * 2));
+                for(std::int64_t i=tp; i<b; ++i) arrays.back()->put(i, a->get(i));
+                a = arrays.back().get();
+                current.store(a, std::memory_order_release);
+            }
+            a->put(b, t);
+            bottom.store(b + 1, std::memory_order_release);
+        }
+        task *                                          take()
+        {
+            const std::int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+            array * a = current.load(std::memory_order_relaxed);
+            bottom.store(b, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            std::int64_t t = top.load(std::memory_order_relaxed);
+            if(t > b) { bottom.store(b + 1, std::memory_order_relaxed); return nullptr; }
+            task * x = a->get(b);
+            if(t == b)
+            {
+                if(!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) x = nullptr;
+                bottom.store(b + 1, std::memory_order_relaxed);
+            }
+            return x;
+        }
+        task *                                          steal()
+        {
+            std::int64_t t = top.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            const std::int64_t b = bottom.load(std::memory_order_acquire);
+            if(t >= b) return nullptr;
+            task * x = current.load(std::memory_order_acquire)->get(t);
+            return top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed) ? x : nullptr;
+        }
+    };
+
+    // Workers are over-aligned by their deques, so they are allocated from the default resource, which honours the alignment
+    struct worker
+    {
+        any_function_executor *                         owner;
+        work_deque                                      deque;
+        std::uint32_t                                   seed;
+        std::thread                                     thread;
+    };
+    struct worker_deleter                               { void operator()(worker * w) const { w->~worker(); any_function::deallocate(any_function::default_resource(), w, sizeof(worker), alignof(worker)); } };
+    static worker *&                                    current_worker()                                        { static thread_local worker * w = nullptr; return w; }
+
+    std::vector<std::unique_ptr<worker, worker_deleter>> workers;
+    std::mutex                                          mutex;
+    std::condition_variable                             wake, idle;
+    std::deque<task *>                                  injected;
+    std::atomic<std::size_t>                            injected_count, queued, unfinished;
+    std::atomic<unsigned>                               sleepers;
+    bool                                                stopping;
+    std::exception_ptr                                  error;
+
+    task *                                              find_task(worker & w)
+    {
+        if(task * t = w.deque.take()) return t;
+        // injected_count mirrors injected.size(), so that workers only take the lock when there is something to take
+        if(injected_count.load(std::memory_order_relaxed) > 0)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(!injected.empty()) { task * t = injected.front(); injected.pop_front(); injected_count.store(injected.size(), std::memory_order_relaxed); return t; }
+        }
+        const std::size_t n = workers.size();
+        w.seed ^= w.seed << 13; w.seed ^= w.seed >> 17; w.seed ^= w.seed << 5;
+        for(std::size_t i=0; i<n; ++i) if(task * t = workers[(w.seed + i) % n]->deque.steal()) return t;
+        return nullptr;
+    }
+    void                                                run(task * t)
+    {
+        queued.fetch_sub(1, std::memory_order_relaxed);
+        try { t->invoke(); }
+        catch(...) { std::lock_guard<std::mutex> lock(mutex); if(!error) error = std::current_exception(); }
+        destroy(t);
+        if(unfinished.fetch_sub(1, std::memory_order_acq_rel) == 1) { std::lock_guard<std::mutex> lock(mutex); idle.notify_all(); }
+    }
+    void                                                work(worker & w)
+    {
+        current_worker() = &w;
+        for(;;)
+        {
+            if(task * t = find_task(w)) { run(t); continue; }
+            std::unique_lock<std::mutex> lock(mutex);
+            sleepers.fetch_add(1, std::memory_order_seq_cst);
+            wake.wait(lock, [this]() { return stopping || queued.load(std::memory_order_seq_cst) > 0; });
+            sleepers.fetch_sub(1, std::memory_order_relaxed);
+            if(stopping && queued.load(std::memory_order_relaxed) == 0) break;
+        }
+        current_worker() = nullptr;
+    }
+public:
+    // Starts thread_count workers, by default one per hardware thread
+    explicit                                            any_function_executor(unsigned thread_count = 0)        : injected_count(0), queued(0), unfinished(0), sleepers(0), stopping(false)
+    {
+        if(thread_count == 0) thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+        for(unsigned i=0; i<thread_count; ++i)
+        {
+            void * p = any_function::allocate(any_function::default_resource(), sizeof(worker), alignof(worker));
+            workers.push_back(std::unique_ptr<worker, worker_deleter>(new(p) worker{this, {}, 2463534242u + i, {}}));
+        }
+        for(auto & w : workers) { worker * p = w.get(); p->thread = std::thread([this, p]() { work(*p); }); }
+    }
+                                                        any_function_executor(const any_function_executor &)    = delete;
+    any_function_executor &                             operator = (const any_function_executor &)              = delete;
+
+    // Waits for all submitted calls to finish, then stops the workers. Exceptions thrown by calls and not yet reported are discarded.
+                                                        ~any_function_executor()
+    {
+        { std::unique_lock<std::mutex> lock(mutex); idle.wait(lock, [this]() { return unfinished.load(std::memory_order_acquire) == 0; }); stopping = true; }
+        wake.notify_all();
+        for(auto & w : workers) w->thread.join();
+    }
+
+    unsigned                                            thread_count() const                                    { return static_cast<unsigned>(workers.size()); }
+
+    // Submits a call to be invoked on one of the workers, discarding its result. May be called from any thread, including workers.
+    void                                                submit(any_function::bound_call call)
+    {
+        task * t = create(std::move(call));
+        unfinished.fetch_add(1, std::memory_order_relaxed);
+        queued.fetch_add(1, std::memory_order_seq_cst);
+        worker * w = current_worker();
+        if(w && w->owner == this)
+        {
+            w->deque.push(t);
+            if(sleepers.load(std::memory_order_seq_cst) > 0) { { std::lock_guard<std::mutex> lock(mutex); } wake.notify_one(); }
+        }
+        else
+        {
+            { std::lock_guard<std::mutex> lock(mutex); injected.push_back(t); injected_count.store(injected.size(), std::memory_order_relaxed); }
+            if(sleepers.load(std::memory_order_seq_cst) > 0) wake.notify_one();
+        }
+    }
+    template<class... A> void                           submit(const any_function & f, A &&... args) { submit(f.bind(std::forward<A>(args)...)); }
+
+    // Executor interface used by invoke_async(...)
+    template<class F> void                              execute(F && f)                                         { submit(any_function(std::forward<F>(f)).bind()); }
+
+    // Blocks until every submitted call has finished, then rethrows the first exception thrown by a call since the last wait, if
+    // any. Must not be called from a worker.
+    void                                                wait_idle()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this]() { return unfinished.load(std::memory_order_acquire) == 0; });
+        if(error) { std::exception_ptr e = error; error = nullptr; std::rethrow_exception(e); }
+    }
+};
+
+#endif
@@ -0,0 +1,175 @@
+// any_function_memo - Memoization of pure any_function callables in a bounded, sharded cache
+//
+// any_function_memo wraps an any_function whose result depends only on the values of its arguments, and caches the results of
+// recent calls keyed on copies of those values. Every parameter type must have a hash and an equality, which are registered once
+// per type with register_type<T>(); arithmetic types and std::string are registered already. The cache is split into shards, each
+// with its own lock and least-recently-used list, so that calls with different arguments rarely contend with each other.
+//
+// This is free and unencumbered software released into the public domain, under the same terms as any_function.h.
+
+#pragma once
+#ifndef ANY_FUNCTION_MEMO_H
+#define ANY_FUNCTION_MEMO_H
+
+#include "any_function.h"
+#include <atomic>           // For std::atomic<T>
+#include <iterator>         // For std::prev(...)
+#include <list>             // For std::list<T>
+#include <mutex>            // For std::mutex
+#include <string>           // For std::string
+#include <unordered_map>    // For std::unordered_map<K,V>, std::unordered_multimap<K,V>
+
+class any_function_memo
+{
+    // Hashes, compares and copies argument values of one registered type
+    struct key_ops
+    {
+        std::size_t                                     (*hash)(const void * a);
+        bool                                            (*equal)(const void * a, const void * b);
+        any_function::result                            (*copy)(const void * a);
+    };
+    template<class T, class Hash, class Equal> struct typed_key_ops
+    {
+        static const T &                                get(const void * p)                                     { return *static_cast<const T *>(p); }
+        static std::size_t                              hash(const void * a)                                    { return Hash()(get(a)); }
+        static bool                                     equal(const void * a, const void * b)                   { return Equal()(get(a), get(b)); }
+        static any_function::result                     copy(const void * a)                                    { return any_function::result::capture<T>(get(a)); }
+        static const key_ops *                          table()                                                 { static const key_ops t = {&hash, &equal, &copy}; return &t; }
+    };
+    typedef std::unordered_map<any_function::type, const key_ops *> key_ops_map;
+    static std::mutex &                                 registry_mutex()                                        { static std::mutex m; return m; }
+    static key_ops_map &                                registry()
+    {
+        static key_ops_map r = []()
+        {
+            key_ops_map r;
+            add<bool>(r); add<char>(r); add<signed char>(r); add<unsigned char>(r); add<wchar_t>(r); add<char16_t>(r); add<char32_t>(r);
+            add<short>(r); add<unsigned short>(r); add<int>(r); add<unsigned>(r); add<long>(r); add<unsigned long>(r); add<long long>(r); add<unsigned long long>(r);
+            add<float>(r); add<double>(r); add<long double>(r); add<std::string>(r);
+            return r;
+        }();
+        return r;
+    }
+    template<class T, class Hash = std::hash<T>, class Equal = std::equal_to<T>> static void add(key_ops_map & r) { r[any_function::type::capture<T>()] = typed_key_ops<T, Hash, Equal>::table(); }
+
+    // A cached call, keyed on copies of its arguments, most recently used first
+    struct entry
+    {
+        std::size_t                                     hash;
+        std::vector<any_function::result>               key;
+        any_function::result                            value;
+    };
+    // Shards are padded to separate cache lines, so they are allocated from the default resource, which honours the alignment
+    struct alignas(64) shard
+    {
+        std::mutex                                      mutex;
+        std::list<entry>                                entries;
+        std::unordered_multimap<std::size_t, std::list<entry>::iterator> index;
+        std::atomic<std::uint64_t>                      hits, misses;
+                                                        shard()                                                 : hits(0), misses(0) {}
+    };
+    struct shard_deleter                                { void operator()(shard * s) const { s->~shard(); any_function::deallocate(any_function::default_resource(), s, sizeof(shard), alignof(shard)); } };
+
+    any_function                                        function;
+    std::vector<const key_ops *>                        keys;
+    std::vector<std::unique_ptr<shard, shard_deleter>>  shards;
+    std::size_t                                         shard_capacity;
+
+    std::size_t                                         hash_of(void * const args[]) const                      { std::size_t h = keys.size(); for(std::size_t i=0; i<keys.size(); ++i) h ^= keys[i]->hash(args[i]) + 0x9e3779b9 + (h << 6) + (h >> 2); return h; }
+    shard &                                             shard_of(std::size_t h) const                           { return *shards[static_cast<std::size_t>((std::uint64_t(h) * 0x9e3779b97f4a7c15ull) >> 40) % shards.size()]; }
+    std::list<entry>::iterator                          find(shard & s, std::size_t h, void * const args[]) const
+    {
+        auto range = s.index.equal_range(h);
+        for(auto it = range.first; it != range.second; ++it)
+        {
+            auto & key = it->second->key;
+            std::size_t i = 0;
+            while(i < keys.size() && keys[i]->equal(args[i], key[i].get_address())) ++i;
+            if(i == keys.size()) return it->second;
+        }
+        return s.entries.end();
+    }
+public:
+    // Memoizes f, caching up to capacity results in total across shard_count shards. Throws std::invalid_argument if f is empty or
+    // if any of its parameter types has not been registered.
+                                                        any_function_memo(any_function f, std::size_t capacity, std::size_t shard_count = 16) : function(std::move(f))
+    {
+        if(!function) throw std::invalid_argument("any_function_memo: empty function");
+        {
+            std::lock_guard<std::mutex> lock(registry_mutex());
+            for(auto & t : function.get_parameter_types())
+            {
+                auto it = registry().find(t.unqualified());
+                if(it == registry().end()) throw std::invalid_argument("any_function_memo: parameter type has no registered hash");
+                keys.push_back(it->second);
+            }
+        }
+        if(shard_count == 0) shard_count = 1;
+        for(std::size_t i=0; i<shard_count; ++i) shards.push_back(std::unique_ptr<shard, shard_deleter>(new(any_function::allocate(any_function::default_resource(), sizeof(shard), alignof(shard))) shard));
+        shard_capacity = std::max<std::size_t>((capacity + shard_count - 1) / shard_count, 1);
+    }
+
+    // Registers the hash and equality used for arguments of type T, or of any cv- or reference-qualified form of T. Must be called
+    // before constructing a memo for a function with such a parameter.
+    template<class T, class Hash = std::hash<T>, class Equal = std::equal_to<T>> static void register_type() { std::lock_guard<std::mutex> lock(registry_mutex()); add<T, Hash, Equal>(registry()); }
+
+    const any_function &                                get_function() const                                    { return function; }
+
+    // Returns a copy of the cached result for these argument values, or invokes the function and caches a copy of its result. The
+    // function is invoked without holding any lock, so concurrent misses on the same arguments may each invoke it. The arguments
+    // are copied before the call, as the function may move from r-value reference arguments. Exceptions are propagated and not cached.
+    any_function::result                                invoke(void * const args[])
+    {
+        const std::size_t h = hash_of(args);
+        shard & s = shard_of(h);
+        {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            auto it = find(s, h, args);
+            if(it != s.entries.end())
+            {
+                s.hits.fetch_add(1, std::memory_order_relaxed);
+                s.entries.splice(s.entries.begin(), s.entries, it);
+                return it->value;
+            }
+        }
+        s.misses.fetch_add(1, std::memory_order_relaxed);
+
+        entry e {h, {}, {}};
+        std::vector<void *> key_args(keys.size());
+        for(std::size_t i=0; i<keys.size(); ++i) { e.key.push_back(keys[i]->copy(args[i])); key_args[i] = e.key[i].get_address(); }
+        e.value = function.invoke(args);
+        any_function::result r = e.value;
+
+        std::lock_guard<std::mutex> lock(s.mutex);
+        if(find(s, h, key_args.data()) != s.entries.end()) return r;
+        s.entries.push_front(std::move(e));
+        s.index.emplace(h, s.entries.begin());
+        if(s.entries.size() > shard_capacity)
+        {
+            auto oldest = std::prev(s.entries.end());
+            auto range = s.index.equal_range(oldest->hash);
+            for(auto it = range.first; it != range.second; ++it) if(it->second == oldest) { s.index.erase(it); break; }
+            s.entries.pop_back();
+        }
+        return r;
+    }
+    any_function::result                                invoke(std::initializer_list<void *> args)              { return invoke(args.begin()); }
+    template<class... A> any_function::result           invoke(const any_function::arguments<A...> & args)
+    {
+        const any_function::type types[] = {any_function::type::capture<A>()..., any_function::type{}};
+        const auto params = function.get_parameter_types();
+        if(params.size() != sizeof...(A) || !std::equal(params.begin(), params.end(), types)) throw std::invalid_argument("any_function_memo::invoke: argument type mismatch");
+        return invoke(args.data());
+    }
+
+    // Counters summed across all shards
+    std::uint64_t                                       hits() const                                            { std::uint64_t n = 0; for(auto & s : shards) n += s->hits.load(std::memory_order_relaxed); return n; }
+    std::uint64_t                                       misses() const                                          { std::uint64_t n = 0; for(auto & s : shards) n += s->misses.load(std::memory_order_relaxed); return n; }
+    std::size_t                                         size() const                                            { std::size_t n = 0; for(auto & s : shards) { std::lock_guard<std::mutex> lock(s->mutex); n += s->entries.size(); } return n; }
+    std::size_t                                         capacity() const                                        { return shard_capacity * shards.size(); }
+
+    // Discards every cached result, leaving the counters unchanged
+    void                                                clear()                                                 { for(auto & s : shards) { std::lock_guard<std::mutex> lock(s->mutex); s->index.clear(); s->entries.clear(); } }
+};
+
+#endif
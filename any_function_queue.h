@@ -0,0 +1,119 @@
+// any_function_queue - Bounded multi-producer, single-consumer queue of deferred any_function calls
+//
+// Producers push an any_function together with the values of its arguments, which are copied into inline storage in a
+// preallocated slot of a ring buffer. A single consumer pops calls in order and invokes them. Neither pushing nor popping
+// allocates, apart from any heap storage needed by the argument values themselves or by large results.
+//
+// This is free and unencumbered software released into the public domain, under the same terms as any_function.h.
+
+#pragma once
+#ifndef ANY_FUNCTION_QUEUE_H
+#define ANY_FUNCTION_QUEUE_H
+
+#include "any_function.h"
+#include <atomic>       // For std::atomic<T>
+#include <tuple>        // For std::tuple<T...>
+
+// Based on Dmitry Vyukov's bounded MPMC queue. Each slot carries a sequence number, which tells producers whether the slot is free
+// for the current lap of the ring, and tells the consumer whether the slot has been filled. Producers claim slots by advancing the
+// tail with a compare-and-swap, and the single consumer owns the head outright.
+template<std::size_t ArgumentSize = 8*sizeof(void *)> class any_function_queue
+{
+    template<size_t... I> struct indices {};
+    template<std::size_t N, std::size_t... IS> struct build_indices : build_indices<N-1, N-1, IS...> {};
+    template<std::size_t... IS> struct build_indices<0, IS...> : indices<IS...> {};
+
+    typedef typename std::aligned_storage<ArgumentSize, alignof(std::max_align_t)>::type argument_storage;
+    struct argument_ops
+    {
+        void                                            (*invoke)(const any_function & f, argument_storage & s);
+        void                                            (*destroy)(argument_storage & s);
+    };
+    template<class T> struct boxed
+    {
+        static T &                                      get(argument_storage & s)                               { return *reinterpret_cast<T *>(&s); }
+        template<size_t... I> static void               call(const any_function & f, T & t, indices<I...>) { void * args[] = {std::addressof(std::get<I>(t))..., nullptr}; f.invoke(args); }
+        static void                                     invoke(const any_function & f, argument_storage & s) { call(f, get(s), build_indices<std::tuple_size<T>::value>{}); }
+        static void                                     destroy(argument_storage & s)                           { get(s).~T(); }
+        static const argument_ops *                     table()                                                 { static const argument_ops t = {&invoke, &destroy}; return &t; }
+    };
+
+    struct slot
+    {
+        std::atomic<std::size_t>                        sequence;
+        const argument_ops *                            ops;
+        any_function                                    function;
+        argument_storage                                arguments;
+    };
+
+    slot *                                              slots;
+    std::size_t                                         mask;
+    alignas(64) std::atomic<std::size_t>                tail;
+    alignas(64) std::size_t                             head;
+public:
+    // Capacity is rounded up to a power of two
+    explicit                                            any_function_queue(std::size_t capacity)                : mask(capacity < 2 ? 1 : capacity - 1), tail(0), head(0)
+    {
+        for(std::size_t shift=1; shift<sizeof(std::size_t)*8; shift*=2) mask |= mask >> shift;
+        slots = new slot[mask + 1];
+        for(std::size_t i=0; i<=mask; ++i) { slots[i].sequence.store(i, std::memory_order_relaxed); slots[i].ops = nullptr; }
+    }
+                                                        any_function_queue(const any_function_queue &)          = delete;
+    any_function_queue &                                operator = (const any_function_queue &)                 = delete;
+                                                        ~any_function_queue()                                   { while(try_pop(false)) {} delete[] slots; }
+
+    std::size_t                                         capacity() const                                        { return mask + 1; }
+
+    // Called by any number of producers. Copies or moves args into a free slot, to be passed to f when the call is popped. Each
+    // parameter of f must be a possibly cv- or reference-qualified form of the decayed type of the corresponding argument. Returns
+    // false without consuming f or args if the queue is full, and throws std::invalid_argument if the arguments do not match.
+    template<class... A> bool                           try_push(any_function && f, A &&... args)
+    {
+        typedef std::tuple<typename std::decay<A>::type...> tuple_type;
+        static_assert(sizeof(tuple_type) <= sizeof(argument_storage) && alignof(tuple_type) <= alignof(argument_storage), "arguments do not fit in ArgumentSize bytes");
+        const any_function::type expected[] = {any_function::type::capture<typename std::decay<A>::type>()..., any_function::type{}};
+        const auto params = f.get_parameter_types();
+        if(params.size() != sizeof...(A)) throw std::invalid_argument("any_function_queue::try_push: wrong number of arguments");
+        for(std::size_t i=0; i<params.size(); ++i) if(params[i].unqualified() != expected[i]) throw std::invalid_argument("any_function_queue::try_push: argument type mismatch");
+
+        std::size_t pos = tail.load(std::memory_order_relaxed);
+        slot * s;
+        for(;;)
+        {
+            s = &slots[pos & mask];
+            const auto diff = static_cast<std::ptrdiff_t>(s->sequence.load(std::memory_order_acquire) - pos);
+            if(diff == 0 && tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            else if(diff < 0) return false;
+            else if(diff > 0) pos = tail.load(std::memory_order_relaxed);
+        }
+
+        // The slot is ours and must be published even if an argument throws while being copied, in which case it is left empty
+        struct publish { slot * s; std::size_t pos; ~publish() { s->sequence.store(pos + 1, std::memory_order_release); } } guard {s, pos};
+        new(&s->arguments) tuple_type(std::forward<A>(args)...);
+        s->ops = boxed<tuple_type>::table();
+        s->function = std::move(f);
+        return true;
+    }
+
+    // Called by the single consumer. Invokes the oldest call in the queue, discarding its result, and returns true, or returns false
+    // if the queue is empty. If the call throws, its slot is still released before the exception propagates.
+    bool                                                try_pop()                                               { return try_pop(true); }
+
+    // Called by the single consumer. Invokes calls until the queue is empty, and returns the number of calls invoked.
+    std::size_t                                         drain()                                                 { std::size_t n = 0; while(try_pop()) ++n; return n; }
+private:
+    bool                                                try_pop(bool invoke)
+    {
+        slot & s = slots[head & mask];
+        if(s.sequence.load(std::memory_order_acquire) != head + 1) return false;
+        struct release
+        {
+            any_function_queue & q; slot & s;
+            ~release() { if(s.ops) s.ops->destroy(s.arguments); s.ops = nullptr; s.function = nullptr; s.sequence.store(q.head + q.mask + 1, std::memory_order_release); ++q.head; }
+        } guard {*this, s};
+        if(invoke && s.ops) s.ops->invoke(s.function, s.arguments);
+        return true;
+    }
+};
+
+#endif
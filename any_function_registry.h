@@ -0,0 +1,138 @@
+// any_function_registry - Name-keyed table of any_function objects with perfect hash lookup
+//
+// Functions are registered by name, after which the registry is frozen. Freezing builds a minimal perfect hash over the names and
+// stores the functions in a contiguous array in hash order, so that each lookup hashes the name once, reads one displacement seed
+// and one entry, and compares the name against the single candidate it finds there.
+//
+// This is free and unencumbered software released into the public domain, under the same terms as any_function.h.
+
+#pragma once
+#ifndef ANY_FUNCTION_REGISTRY_H
+#define ANY_FUNCTION_REGISTRY_H
+
+#include "any_function.h"
+#include <algorithm>    // For std::sort(...)
+#include <cstring>      // For std::memcmp(...), std::strlen(...)
+#include <string>       // For std::string
+
+// Based on the hash and displace scheme of Belazzougui, Botelho and Dietzfelbinger. Names are hashed once and split into buckets of
+// about two names each. Working from the largest bucket down, each bucket is assigned the first seed which places all of its names
+// in free slots, so that slot_of(hash) = reduce(mix(hash + seed[bucket]), size) maps n names to n slots with no collisions.
+class any_function_registry
+{
+    struct entry
+    {
+        std::uint64_t                                   hash;
+        any_function                                    function;
+        std::string                                     name;
+    };
+    std::vector<entry>                                  entries;
+    std::vector<std::uint32_t>                          seeds;
+    bool                                                frozen;
+
+    static std::uint64_t                                hash(const char * name, std::size_t length)             { std::uint64_t h = 14695981039346656037ull; for(std::size_t i=0; i<length; ++i) h = (h ^ static_cast<unsigned char>(name[i])) * 1099511628211ull; return h; }
+    static std::uint64_t                                mix(std::uint64_t h)                                    { h ^= h >> 33; h *= 0xff51afd7ed558ccdull; h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ull; return h ^ (h >> 33); }
+    static std::size_t                                  reduce(std::uint64_t h, std::size_t n)                  { return static_cast<std::size_t>(((h >> 32) * n) >> 32); }
+    std::size_t                                         bucket_of(std::uint64_t h) const                        { return static_cast<std::size_t>(h) & (seeds.size() - 1); }
+    std::size_t                                         slot_of(std::uint64_t h, std::uint32_t seed) const      { return reduce(mix(h + seed * 0x9e3779b97f4a7c15ull), entries.size()); }
+    const entry *                                       lookup(const char * name, std::size_t length) const
+    {
+        const std::uint64_t h = hash(name, length);
+        if(!frozen)
+        {
+            for(auto & e : entries) if(e.hash == h && e.name.size() == length && std::memcmp(e.name.data(), name, length) == 0) return &e;
+            return nullptr;
+        }
+        if(entries.empty()) return nullptr;
+        const entry & e = entries[slot_of(h, seeds[bucket_of(h)])];
+        return e.hash == h && e.name.size() == length && std::memcmp(e.name.data(), name, length) == 0 ? &e : nullptr;
+    }
+public:
+                                                        any_function_registry()                                 : frozen(false) {}
+
+    std::size_t                                         size() const                                            { return entries.size(); }
+    bool                                                is_frozen() const                                       { return frozen; }
+
+    // Registers f under name. Throws std::logic_error if the registry has been frozen. Duplicate names are reported by freeze().
+    void                                                add(std::string name, any_function f)
+    {
+        if(frozen) throw std::logic_error("any_function_registry::add: registry is frozen");
+        const std::uint64_t h = hash(name.data(), name.size());
+        entries.push_back({h, std::move(f), std::move(name)});
+    }
+
+    // Builds the perfect hash and reorders the functions into their slots. Lookups before freezing scan the functions linearly.
+    // Throws std::invalid_argument if two functions were registered under the same name, in which case the registry is unchanged.
+    void                                                freeze()
+    {
+        if(frozen) return;
+        const std::size_t n = entries.size();
+        std::size_t bucket_count = 1;
+        while(bucket_count * 2 < n) bucket_count *= 2;
+        std::vector<std::uint32_t> new_seeds(bucket_count);
+        seeds.swap(new_seeds);
+
+        // Group entries by bucket, largest buckets first
+        std::vector<std::size_t> order(n);
+        for(std::size_t i=0; i<n; ++i) order[i] = i;
+        std::vector<std::size_t> bucket_sizes(bucket_count);
+        for(auto & e : entries) ++bucket_sizes[bucket_of(e.hash)];
+        std::sort(begin(order), end(order), [&](std::size_t a, std::size_t b)
+        {
+            const std::size_t ba = bucket_of(entries[a].hash), bb = bucket_of(entries[b].hash);
+            if(bucket_sizes[ba] != bucket_sizes[bb]) return bucket_sizes[ba] > bucket_sizes[bb];
+            if(ba != bb) return ba < bb;
+            if(entries[a].hash != entries[b].hash) return entries[a].hash < entries[b].hash;
+            return entries[a].name < entries[b].name;
+        });
+
+        // Find a seed for each bucket which sends all of its entries to distinct free slots
+        std::vector<std::size_t> owners(n, n), candidate;
+        for(std::size_t first=0, last; first<n; first=last)
+        {
+            const std::size_t bucket = bucket_of(entries[order[first]].hash);
+            for(last=first+1; last<n && bucket_of(entries[order[last]].hash) == bucket; ++last)
+            {
+                if(entries[order[last]].hash == entries[order[last-1]].hash)
+                {
+                    seeds.swap(new_seeds);
+                    throw std::invalid_argument(entries[order[last]].name == entries[order[last-1]].name ? "any_function_registry::freeze: duplicate name" : "any_function_registry::freeze: name hash collision");
+                }
+            }
+            for(std::uint32_t seed=0; ; ++seed)
+            {
+                candidate.clear();
+                for(std::size_t i=first; i<last; ++i)
+                {
+                    const std::size_t slot = slot_of(entries[order[i]].hash, seed);
+                    if(owners[slot] != n || std::find(begin(candidate), end(candidate), slot) != end(candidate)) break;
+                    candidate.push_back(slot);
+                }
+                if(candidate.size() < last - first) continue;
+                for(std::size_t i=first; i<last; ++i) owners[candidate[i-first]] = order[i];
+                seeds[bucket] = seed;
+                break;
+            }
+        }
+
+        std::vector<entry> sorted;
+        sorted.reserve(n);
+        for(std::size_t i : owners) sorted.push_back(std::move(entries[i]));
+        entries.swap(sorted);
+        frozen = true;
+    }
+
+    // Returns the function registered under name, or nullptr if there is none
+    const any_function *                                find(const char * name, std::size_t length) const       { auto e = lookup(name, length); return e ? &e->function : nullptr; }
+    const any_function *                                find(const char * name) const                           { return find(name, std::strlen(name)); }
+    const any_function *                                find(const std::string & name) const                    { return find(name.data(), name.size()); }
+
+    // Returns the function registered under name, or nullptr if there is none or if its signature is not F, as in find<int(int)>(name).
+    // Signatures are interned, so the check compares the address of the signature and does not touch the signature itself.
+    template<class F> const any_function *              find(const std::string & name) const                    { auto e = lookup(name.data(), name.size()); return e && e->function.has_signature<F>() ? &e->function : nullptr; }
+
+    // Returns the function registered under name, or throws std::out_of_range if there is none
+    const any_function &                                at(const std::string & name) const                      { if(auto f = find(name)) return *f; throw std::out_of_range("any_function_registry::at: no function registered under name"); }
+};
+
+#endif
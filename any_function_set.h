@@ -0,0 +1,109 @@
+// any_function_set - Overload sets of any_function objects, resolved by the types of the arguments at runtime
+//
+// Each member of a set is an any_function with its own signature. A call supplies the types of its arguments alongside pointers
+// to them, and is dispatched to the member whose parameter types, ignoring cv- and reference-qualifiers, match the argument types
+// exactly. Members are indexed by a hash of their arity and parameter types, so resolution takes constant time however large the
+// set grows, and a call_site remembers the last member it resolved to, so that repeated calls with the same types skip the index.
+//
+// This is free and unencumbered software released into the public domain, under the same terms as any_function.h.
+
+#pragma once
+#ifndef ANY_FUNCTION_SET_H
+#define ANY_FUNCTION_SET_H
+
+#include "any_function.h"
+
+class any_function_set
+{
+    struct member
+    {
+        any_function                                    function;
+        std::size_t                                     hash, next;
+    };
+    std::vector<member>                                 members;
+    std::vector<std::size_t>                            buckets;
+    std::uint64_t                                       arities;
+
+    static const std::size_t                            npos = static_cast<std::size_t>(-1);
+    static std::uint64_t                                arity_bit(std::size_t n)                                { return std::uint64_t(1) << (n < 63 ? n : 63); }
+    static std::size_t                                  hash_of(const any_function::type * types, std::size_t n)
+    {
+        std::size_t h = n;
+        for(std::size_t i=0; i<n; ++i) h ^= std::hash<any_function::type>()(types[i].unqualified()) + 0x9e3779b9 + (h << 6) + (h >> 2);
+        return h;
+    }
+    static bool                                         matches(const any_function & f, const any_function::type * types, std::size_t n)
+    {
+        const auto params = f.get_parameter_types();
+        if(params.size() != n) return false;
+        for(std::size_t i=0; i<n; ++i) if(params[i].unqualified() != types[i].unqualified()) return false;
+        return true;
+    }
+    std::size_t                                         find(const any_function::type * types, std::size_t n) const
+    {
+        if(!(arities & arity_bit(n))) return npos;
+        const std::size_t h = hash_of(types, n);
+        for(std::size_t i = buckets[h & (buckets.size() - 1)]; i != npos; i = members[i].next) if(members[i].hash == h && matches(members[i].function, types, n)) return i;
+        return npos;
+    }
+    void                                                link(std::size_t i)                                     { std::size_t & head = buckets[members[i].hash & (buckets.size() - 1)]; members[i].next = head; head = i; }
+public:
+    class call_site;
+
+                                                        any_function_set()                                      : arities() {}
+
+    std::size_t                                         size() const                                            { return members.size(); }
+    const any_function &                                operator [] (std::size_t i) const                       { return members[i].function; }
+
+    // Adds an overload. Throws std::invalid_argument if f is empty, or if a member already has the same parameter types as f, once
+    // cv- and reference-qualifiers are removed, as calls could not then be resolved between them.
+    void                                                add(any_function f)
+    {
+        if(!f) throw std::invalid_argument("any_function_set::add: empty function");
+        const auto params = f.get_parameter_types();
+        if(find(params.begin(), params.size()) != npos) throw std::invalid_argument("any_function_set::add: ambiguous overload");
+        members.push_back({std::move(f), hash_of(params.begin(), params.size()), npos});
+        arities |= arity_bit(params.size());
+        if(members.size() > buckets.size())
+        {
+            buckets.assign(std::max<std::size_t>(buckets.size() * 2, 8), std::size_t(npos));
+            for(std::size_t i=0; i<members.size(); ++i) link(i);
+        }
+        else link(members.size() - 1);
+    }
+
+    // Returns the member whose parameter types match the argument types, or nullptr if there is none
+    const any_function *                                resolve(const any_function::type types[], std::size_t n) const { const std::size_t i = find(types, n); return i == npos ? nullptr : &members[i].function; }
+    const any_function *                                resolve(std::initializer_list<any_function::type> types) const { return resolve(types.begin(), types.size()); }
+
+    // Invokes the member whose parameter types match the argument types, where args[i] points to an object of type types[i]. Throws
+    // std::invalid_argument if no member matches.
+    any_function::result                                invoke(const any_function::type types[], void * const args[], std::size_t n) const { if(auto f = resolve(types, n)) return f->invoke(args); throw std::invalid_argument("any_function_set::invoke: no overload matches the argument types"); }
+    any_function::result                                invoke(std::initializer_list<any_function::type> types, std::initializer_list<void *> args) const { assert(types.size() == args.size()); return invoke(types.begin(), args.begin(), types.size()); }
+};
+
+// Inline cache for one call site, such as one call expression in a script. Remembers the member which its last call resolved to,
+// and checks the argument types of the next call against that member's parameter types directly, only consulting the index of the
+// set when they differ. A set may be assigned a different set of members, so the cached index is checked against the size of the
+// set before the member it names is compared.
+class any_function_set::call_site
+{
+    const any_function_set *                            set;
+    std::size_t                                         index;
+public:
+                                                        call_site()                                             : set(), index() {}
+
+    const any_function *                                resolve(const any_function_set & s, const any_function::type types[], std::size_t n)
+    {
+        if(set == &s && index < s.members.size() && matches(s.members[index].function, types, n)) return &s.members[index].function;
+        index = s.find(types, n);
+        set = index == npos ? nullptr : &s;
+        return set ? &s.members[index].function : nullptr;
+    }
+    const any_function *                                resolve(const any_function_set & s, std::initializer_list<any_function::type> types) { return resolve(s, types.begin(), types.size()); }
+
+    any_function::result                                invoke(const any_function_set & s, const any_function::type types[], void * const args[], std::size_t n) { if(auto f = resolve(s, types, n)) return f->invoke(args); throw std::invalid_argument("any_function_set::call_site::invoke: no overload matches the argument types"); }
+    any_function::result                                invoke(const any_function_set & s, std::initializer_list<any_function::type> types, std::initializer_list<void *> args) { assert(types.size() == args.size()); return invoke(s, types.begin(), args.begin(), types.size()); }
+};
+
+#endif
@@ -0,0 +1,255 @@
+// Benchmarks for any_function. Each line of output is a CSV record of the form:
+//
+//     benchmark,iterations,ns_per_op,allocs_per_op
+//
+// Pass a substring as the first argument to only run benchmarks whose name contains it.
+
+#include "../any_function.h"
+#include "../any_function_queue.h"
+#include "../any_function_executor.h"
+#include "../any_function_registry.h"
+#include "../any_function_set.h"
+#include "../any_function_memo.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+//////////////////////////////////////////////////////
+// Count every allocation made through operator new //
+//////////////////////////////////////////////////////
+
+static std::atomic<std::size_t> allocation_count {0}; // Atomic, as some benchmarks allocate from worker threads
+void * operator new(std::size_t size) { ++allocation_count; if(void * p = std::malloc(size ? size : 1)) return p; throw std::bad_alloc(); }
+void * operator new[](std::size_t size) { return operator new(size); }
+void operator delete(void * p) noexcept { std::free(p); }
+void operator delete[](void * p) noexcept { std::free(p); }
+void operator delete(void * p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void * p, std::size_t) noexcept { std::free(p); }
+
+////////////////////////////////////////////
+// Minimal harness for timing a loop body //
+////////////////////////////////////////////
+
+// Prevents the compiler from discarding the computation of x
+template<class T> void do_not_optimize(T & x)
+{
+#if defined(__GNUC__)
+    asm volatile("" : : "g"(&x) : "memory");
+#else
+    static volatile const void * sink; sink = &x;
+#endif
+}
+
+static const char * filter = nullptr;
+
+template<class F> void benchmark(const char * name, F body)
+{
+    if(filter && !std::strstr(name, filter)) return;
+
+    // Double the iteration count until a run takes long enough to time reliably
+    typedef std::chrono::steady_clock clock;
+    for(std::size_t n=1; ; n*=2)
+    {
+        const std::size_t allocations = allocation_count;
+        const auto start = clock::now();
+        for(std::size_t i=0; i<n; ++i) body();
+        const auto elapsed = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+        if(elapsed < 1e8 && n < (std::size_t(1) << 30)) continue;
+        std::printf("%s,%zu,%.3f,%.3f\n", name, n, elapsed / n, double(allocation_count - allocations) / n);
+        std::fflush(stdout);
+        return;
+    }
+}
+
+////////////////////////////////////////
+// Functions and data to benchmark on //
+////////////////////////////////////////
+
+struct large_value { double values[16]; };
+int arity0() { return 1; }
+int arity1(int a) { return a; }
+int arity2(int a, int b) { return a+b; }
+int arity3(int a, int b, int c) { return a+b+c; }
+int arity4(int a, int b, int c, int d) { return a+b+c+d; }
+int arity5(int a, int b, int c, int d, int e) { return a+b+c+d+e; }
+int arity6(int a, int b, int c, int d, int e, int f) { return a+b+c+d+e+f; }
+int arity7(int a, int b, int c, int d, int e, int f, int g) { return a+b+c+d+e+f+g; }
+int arity8(int a, int b, int c, int d, int e, int f, int g, int h) { return a+b+c+d+e+f+g+h; }
+double scalar(double x) { return x*2; }
+void nothing(double) {}
+large_value large(double x) { large_value v; for(auto & d : v.values) d = x; return v; }
+double global;
+double & reference(double) { return global; }
+
+template<class F> void benchmark_invoke(const char * name, F f, void * const args[])
+{
+    const any_function af {f};
+    benchmark(name, [&]() { auto r = af.invoke(args); do_not_optimize(r); });
+}
+
+template<class T> void add_overloads_on(any_function_set & set)
+{
+    set.add(any_function{[](T a, int b) { return a+b; }});
+    set.add(any_function{[](T a, double b) { return a+b; }});
+    set.add(any_function{[](T a, float b) { return a+b; }});
+    set.add(any_function{[](T a, char b) { return a+b; }});
+    set.add(any_function{[](T a, long b) { return a+b; }});
+}
+
+int main(int argc, char * argv[])
+{
+    if(argc > 1) filter = argv[1];
+    std::printf("benchmark,iterations,ns_per_op,allocs_per_op\n");
+
+    int ints[8] = {1,2,3,4,5,6,7,8};
+    void * int_args[8] = {&ints[0], &ints[1], &ints[2], &ints[3], &ints[4], &ints[5], &ints[6], &ints[7]};
+    double x = 3.0;
+    void * double_args[1] = {&x};
+    large_value big {};
+
+    // Construction
+    benchmark("construct/function_pointer", [&]() { any_function f {&arity2}; do_not_optimize(f); });
+    benchmark("construct/small_lambda", [&]() { any_function f {[&x](int a) { return a*x; }}; do_not_optimize(f); });
+    benchmark("construct/large_lambda", [&]() { any_function f {[big](int a) { return big.values[a]; }}; do_not_optimize(f); });
+    std::function<int(int, int)> sf {&arity2};
+    benchmark("construct/std_function", [&]() { any_function f {sf}; do_not_optimize(f); });
+    benchmark("baseline/construct/std_function", [&]() { std::function<int(int, int)> f {&arity2}; do_not_optimize(f); });
+
+    // Copying
+    const any_function small_f {[&x](int a) { return a*x; }}, large_f {[big](int a) { return big.values[a]; }};
+    benchmark("copy/small_lambda", [&]() { any_function f {small_f}; do_not_optimize(f); });
+    benchmark("copy/large_lambda", [&]() { any_function f {large_f}; do_not_optimize(f); });
+    const std::function<double(int)> large_sf {[big](int a) { return big.values[a]; }};
+    benchmark("baseline/copy/std_function_large_lambda", [&]() { std::function<double(int)> f {large_sf}; do_not_optimize(f); });
+
+    // Invocation across arities
+    benchmark_invoke("invoke/arity0", &arity0, int_args);
+    benchmark_invoke("invoke/arity1", &arity1, int_args);
+    benchmark_invoke("invoke/arity2", &arity2, int_args);
+    benchmark_invoke("invoke/arity3", &arity3, int_args);
+    benchmark_invoke("invoke/arity4", &arity4, int_args);
+    benchmark_invoke("invoke/arity5", &arity5, int_args);
+    benchmark_invoke("invoke/arity6", &arity6, int_args);
+    benchmark_invoke("invoke/arity7", &arity7, int_args);
+    benchmark_invoke("invoke/arity8", &arity8, int_args);
+
+    // Invocation across return kinds
+    benchmark_invoke("invoke/return_void", &nothing, double_args);
+    benchmark_invoke("invoke/return_scalar", &scalar, double_args);
+    benchmark_invoke("invoke/return_large_value", &large, double_args);
+    benchmark_invoke("invoke/return_reference", &reference, double_args);
+    const any_function arity3_checked {&arity3};
+    benchmark("invoke/arity3_typed_arguments", [&]() { auto r = arity3_checked.invoke(any_function::arguments<int, int, int>(ints[0], ints[1], ints[2])); do_not_optimize(r); });
+    const any_function scalar_f {&scalar};
+    benchmark("invoke_into/return_scalar", [&]() { double out; scalar_f.invoke_into(any_function::type::capture<double>(), &out, double_args); do_not_optimize(out); });
+
+    // Batch invocation, 1024 rows per operation
+    std::vector<int> col_a(1024, 1), col_b(1024, 2), col_c(1024, 3), col_out(1024);
+    const any_function arity3_f {&arity3};
+    benchmark("invoke_batch/arity3_1024_rows", [&]() { arity3_f.invoke_batch(any_function::type::capture<int>(), {col_out.data(), sizeof(int)}, {{col_a.data(), sizeof(int)}, {col_b.data(), sizeof(int)}, {col_c.data(), sizeof(int)}}, 1024); do_not_optimize(col_out); });
+    const any_function arity3_lambda {[](int a, int b, int c) { return a+b+c; }};
+    benchmark("invoke_batch/arity3_lambda_1024_rows", [&]() { arity3_lambda.invoke_batch(any_function::type::capture<int>(), {col_out.data(), sizeof(int)}, {{col_a.data(), sizeof(int)}, {col_b.data(), sizeof(int)}, {col_c.data(), sizeof(int)}}, 1024); do_not_optimize(col_out); });
+    benchmark("invoke_into/arity3_1024_rows", [&]() { for(int i=0; i<1024; ++i) arity3_f.invoke_into(any_function::type::capture<int>(), &col_out[i], {&col_a[i], &col_b[i], &col_c[i]}); do_not_optimize(col_out); });
+
+    // Parallel batch invocation, 1M rows per operation
+    std::vector<int> big_a(1 << 20, 1), big_b(1 << 20, 2), big_c(1 << 20, 3), big_out(1 << 20);
+    benchmark("invoke_batch/arity3_lambda_1M_rows", [&]() { arity3_lambda.invoke_batch(any_function::type::capture<int>(), {big_out.data(), sizeof(int)}, {{big_a.data(), sizeof(int)}, {big_b.data(), sizeof(int)}, {big_c.data(), sizeof(int)}}, big_out.size()); do_not_optimize(big_out); });
+    benchmark("invoke_parallel/arity3_lambda_1M_rows", [&]() { arity3_lambda.invoke_parallel(any_function::type::capture<int>(), {big_out.data(), sizeof(int)}, {{big_a.data(), sizeof(int)}, {big_b.data(), sizeof(int)}, {big_c.data(), sizeof(int)}}, big_out.size()); do_not_optimize(big_out); });
+
+    // Bound calls
+    benchmark("bind/arity3", [&]() { auto call = arity3_f.bind(ints[0], ints[1], ints[2]); do_not_optimize(call); });
+    const auto bound_arity3 = arity3_f.bind(ints[0], ints[1], ints[2]);
+    benchmark("bound_call/invoke_arity3", [&]() { auto r = bound_arity3.invoke(); do_not_optimize(r); });
+
+    // Calls decoded from a packed message, in place and by copying each argument out into a temporary first
+    alignas(int) char packed_args[3*sizeof(int)];
+    std::memcpy(packed_args, ints, sizeof(packed_args));
+    benchmark("invoke_packed/arity3", [&]() { auto r = arity3_f.invoke_packed(packed_args, sizeof(packed_args)); do_not_optimize(r); });
+    benchmark("baseline/invoke/unpacked_temporaries_arity3", [&]() { int a, b, c; std::memcpy(&a, packed_args, 4); std::memcpy(&b, packed_args+4, 4); std::memcpy(&c, packed_args+8, 4); auto r = arity3_f.invoke({&a, &b, &c}); do_not_optimize(r); });
+
+    // Request/response round trips: packed arguments in, serialized return value out, against boxing the result first
+    char response[sizeof(large_value)];
+    const any_function large_value_f {&large};
+    alignas(double) char large_request[sizeof(double)];
+    std::memcpy(large_request, &x, sizeof(x));
+    benchmark("invoke_packed_serialized/arity3", [&]() { auto n = arity3_f.invoke_packed_serialized(response, sizeof(response), packed_args, sizeof(packed_args)); do_not_optimize(n); });
+    benchmark("invoke_packed_serialized/return_large_value", [&]() { auto n = large_value_f.invoke_packed_serialized(response, sizeof(response), large_request, sizeof(large_request)); do_not_optimize(n); });
+    benchmark("baseline/invoke_packed_then_copy_result/return_large_value", [&]() { auto r = large_value_f.invoke_packed(large_request, sizeof(large_request)); std::memcpy(response, r.get_address(), sizeof(large_value)); do_not_optimize(response); });
+
+    // Deferred calls through a queue, pushed and popped on the same thread
+    any_function_queue<> queue {64};
+    const any_function queued_f {[](int a, int b, int c) { return a+b+c; }};
+    benchmark("queue/push_pop_arity3", [&]() { queue.try_push(any_function(queued_f), ints[0], ints[1], ints[2]); queue.try_pop(); });
+
+    // Lookup of one of 10000 functions by name
+    any_function_registry registry;
+    std::unordered_map<std::string, any_function> name_map;
+    std::vector<std::string> names;
+    for(int i=0; i<10000; ++i) { names.push_back("service.method_" + std::to_string(i)); registry.add(names.back(), any_function{&arity0}); name_map.emplace(names.back(), any_function{&arity0}); }
+    registry.freeze();
+    std::size_t name_index = 0;
+    benchmark("registry/find_of_10000", [&]() { auto f = registry.find(names[name_index]); do_not_optimize(f); name_index = (name_index + 7919) % names.size(); });
+    benchmark("baseline/unordered_map_find_of_10000", [&]() { auto f = &name_map.find(names[name_index])->second; do_not_optimize(f); name_index = (name_index + 7919) % names.size(); });
+
+    // Dispatch of a call with two int arguments against a set of 25 overloads, looking for the last member added
+    any_function_set overloads;
+    add_overloads_on<int>(overloads); add_overloads_on<double>(overloads); add_overloads_on<float>(overloads); add_overloads_on<char>(overloads); add_overloads_on<long>(overloads);
+    any_function::type long_long_types[] = {any_function::type::capture<long>(), any_function::type::capture<long>()};
+    long longs[] = {1, 2};
+    void * long_args[] = {&longs[0], &longs[1]};
+    benchmark("set/invoke_of_25", [&]() { auto r = overloads.invoke(long_long_types, long_args, 2); do_not_optimize(r); });
+    any_function_set::call_site site;
+    benchmark("set/call_site_invoke_of_25", [&]() { auto r = site.invoke(overloads, long_long_types, long_args, 2); do_not_optimize(r); });
+    benchmark("baseline/linear_scan_invoke_of_25", [&]()
+    {
+        for(std::size_t i=0; i<overloads.size(); ++i)
+        {
+            const auto params = overloads[i].get_parameter_types();
+            if(params.size() == 2 && params[0] == long_long_types[0] && params[1] == long_long_types[1]) { auto r = overloads[i].invoke(long_args); do_not_optimize(r); break; }
+        }
+    });
+
+    // Repeated calls to an expensive pure function, through a memo and directly
+    const any_function expensive {[](int n, double x) { double s = 0; for(int i=0; i<n; ++i) s += x / (i + 1); return s; }};
+    any_function_memo memo {expensive, 1024};
+    int expensive_n = 1000; double expensive_x = 2.5;
+    benchmark("memo/invoke_hit_arity2", [&]() { auto r = memo.invoke({&expensive_n, &expensive_x}); do_not_optimize(r); });
+    benchmark("baseline/invoke_expensive_arity2", [&]() { auto r = expensive.invoke({&expensive_n, &expensive_x}); do_not_optimize(r); });
+
+    // Fan-out of many small calls from a single root call, on work-stealing executors with 1 to N workers
+    const any_function leaf {[](int n) { int s = 0; for(int i=0; i<n; ++i) s += i*i; do_not_optimize(s); }};
+    int leaf_work = 256;
+    benchmark("baseline/fan_out_1024_calls_serial", [&]() { for(int i=0; i<1024; ++i) leaf.invoke({&leaf_work}); });
+    const unsigned max_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    for(unsigned t=1; ; t=std::min(t*2, max_threads))
+    {
+        any_function_executor executor {t};
+        const any_function root {[&]() { for(int i=0; i<1024; ++i) executor.submit(leaf, leaf_work); }};
+        char name[64]; std::snprintf(name, sizeof(name), "executor/fan_out_1024_calls_%u_threads", t);
+        benchmark(name, [&]() { executor.submit(root); executor.wait_idle(); });
+        if(t == max_threads) break;
+    }
+
+    // Baselines for invocation
+    int (* volatile fp)(int, int, int) = &arity3;
+    benchmark("baseline/invoke/direct_arity3", [&]() { int r = fp(ints[0], ints[1], ints[2]); do_not_optimize(r); });
+    std::function<int(int, int, int)> sf3 {&arity3};
+    benchmark("baseline/invoke/std_function_arity3", [&]() { int r = sf3(ints[0], ints[1], ints[2]); do_not_optimize(r); });
+    std::function<large_value(double)> sf_large {&large};
+    benchmark("baseline/invoke/std_function_return_large_value", [&]() { auto r = sf_large(x); do_not_optimize(r); });
+
+    // Result access
+    const any_function large_result_f {&large};
+    const auto scalar_result = scalar_f.invoke(double_args), large_result = large_result_f.invoke(double_args);
+    benchmark("result/copy_scalar", [&]() { auto r = scalar_result; do_not_optimize(r); });
+    benchmark("result/copy_large_value", [&]() { auto r = large_result; do_not_optimize(r); });
+    benchmark("result/get_value_scalar", [&]() { auto r = scalar_result; double v = r.get_value<double>(); do_not_optimize(v); });
+    return 0;
+}
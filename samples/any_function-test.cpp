@@ -1,4 +1,12 @@
+#define ANY_FUNCTION_COUNT_ALLOCATIONS
 #include "../any_function.h"
+#include "../any_function_queue.h"
+#include "../any_function_async.h"
+#include "../any_function_executor.h"
+#include "../any_function_registry.h"
+#include "../any_function_set.h"
+#include "../any_function_memo.h"
+#include <unordered_map>
 
 #define CATCH_CONFIG_MAIN
 #include "thirdparty/catch.hpp"
@@ -6,11 +14,11 @@
 template<class T> void test_type_capture(const std::type_info & info, bool is_lvalue_reference, bool is_rvalue_reference, bool is_const, bool is_volatile)
 {
     const auto t = any_function::type::capture<T>();
-    REQUIRE( t.info                == &info               );
-    REQUIRE( t.is_lvalue_reference == is_lvalue_reference );
-    REQUIRE( t.is_rvalue_reference == is_rvalue_reference );
-    REQUIRE( t.is_const            == is_const            );
-    REQUIRE( t.is_volatile         == is_volatile         );
+    REQUIRE( t.info()                == &info               );
+    REQUIRE( t.is_lvalue_reference() == is_lvalue_reference );
+    REQUIRE( t.is_rvalue_reference() == is_rvalue_reference );
+    REQUIRE( t.is_const()            == is_const            );
+    REQUIRE( t.is_volatile()         == is_volatile         );
 }
 
 // Test capturing the traits of a number of different types:                                fully qualified type          base type     lvref  rvref  const  vol
@@ -25,6 +33,30 @@ TEST_CASE( "test any_function::type::capture<void>()"                 ) { test_t
 TEST_CASE( "test any_function::type::capture<int *>()"                ) { test_type_capture<               int * >(typeid(      int *), false, false, false, false); }
 TEST_CASE( "test any_function::type::capture<const int *>()"          ) { test_type_capture<const          int * >(typeid(const int *), false, false, false, false); }
 
+TEST_CASE( "any_function::type compares and hashes by its packed word" )
+{
+    const auto a = any_function::type::capture<const int &>(), b = any_function::type::capture<const int &>(), c = any_function::type::capture<int &>();
+    REQUIRE( a == b );
+    REQUIRE( a != c );
+    REQUIRE( a.info() == c.info() );
+    REQUIRE( sizeof(any_function::type) == sizeof(void *) );
+    REQUIRE( any_function::type{}.info() == nullptr );
+    REQUIRE( std::hash<any_function::type>()(a) == std::hash<any_function::type>()(b) );
+
+    std::unordered_map<any_function::type, int> m;
+    m[any_function::type::capture<int>()] = 1;
+    m[any_function::type::capture<int &>()] = 2;
+    REQUIRE( m.size() == 2 );
+    REQUIRE( m[any_function::type::capture<int>()] == 1 );
+}
+
+TEST_CASE( "any_function::type fingerprints depend on the type and its qualifiers" )
+{
+    REQUIRE( any_function::type::capture<int>().fingerprint() == any_function::type::capture<int>().fingerprint() );
+    REQUIRE( any_function::type::capture<int>().fingerprint() != any_function::type::capture<const int &>().fingerprint() );
+    REQUIRE( any_function::type::capture<int>().fingerprint() != any_function::type::capture<float>().fingerprint() );
+}
+
 /////////////////////////////////////////////////
 // Test capturing different types of functions //
 /////////////////////////////////////////////////
@@ -131,6 +163,42 @@ TEST_CASE( "any_function can be constructed with an arity-3 stateless lambda ret
     REQUIRE( f.get_result_type() == any_function::type::capture<void>() );
 }
 
+TEST_CASE( "any_function exposes a fingerprint of its signature" )
+{
+    const any_function f {&global_function}, g {[](int a, double b, float c) { return a*b-c; }}, h {[](int a, double b) { return a*b; }}, k {[](int a, double b, const float & c) { return a*b-c; }};
+    REQUIRE( f.get_signature_fingerprint() == g.get_signature_fingerprint() );
+    REQUIRE( f.get_signature_fingerprint() == any_function::signature_fingerprint<double(int, double, float)>() );
+    REQUIRE( f.get_signature_fingerprint() != h.get_signature_fingerprint() );
+    REQUIRE( f.get_signature_fingerprint() != k.get_signature_fingerprint() );
+    REQUIRE( any_function::signature_fingerprint<void()>() != any_function::signature_fingerprint<int()>() );
+    REQUIRE( any_function::signature_fingerprint<void(int)>() != any_function::signature_fingerprint<int()>() );
+    REQUIRE( any_function{}.get_signature_fingerprint() == 0 );
+}
+
+TEST_CASE( "any_function::has_signature tests the exact signature" )
+{
+    const any_function f {&global_function}, g {[](int a, double b, float c) { return a*b-c; }};
+    REQUIRE( f.has_signature<double(int, double, float)>() );
+    REQUIRE( g.has_signature<double(int, double, float)>() );
+    REQUIRE_FALSE( f.has_signature<double(int, double, const float &)>() );
+    REQUIRE_FALSE( f.has_signature<float(int, double, float)>() );
+    REQUIRE_FALSE( any_function{}.has_signature<void()>() );
+    REQUIRE( any_function_ref{f}.has_signature<double(int, double, float)>() );
+}
+
+TEST_CASE( "any_function objects with the same signature share their parameter types" )
+{
+    const any_function f {&global_function};
+    const any_function g {[](int a, double b, float c) { return a+b+c; }};
+    const any_function copy {f};
+    REQUIRE( f.get_parameter_types().begin() == g.get_parameter_types().begin() );
+    REQUIRE( f.get_parameter_types().begin() == copy.get_parameter_types().begin() );
+
+    int n = 0;
+    for(auto & t : g.get_parameter_types()) REQUIRE( t == f.get_parameter_types()[n++] );
+    REQUIRE( n == 3 );
+}
+
 ///////////////////////////////////////////////
 // Test calling different types of functions //
 ///////////////////////////////////////////////
@@ -410,4 +478,1093 @@ TEST_CASE( "any_function can capture mutable lambdas" )
     REQUIRE( f.invoke({}).get_value<int>() == 3 );
     REQUIRE( f.invoke({}).get_value<int>() == 4 );
     REQUIRE( f.invoke({}).get_value<int>() == 5 );
-}
\ No newline at end of file
+}
+
+///////////////////////////////////////////
+// Test copying and moving result values //
+///////////////////////////////////////////
+
+TEST_CASE( "any_function::result stores small values inline" )
+{
+    const any_function f {[]() { return 5.0; }};
+    auto r = f.invoke({});
+    const char * address = reinterpret_cast<const char *>(r.get_address());
+    const bool is_inline = address >= reinterpret_cast<const char *>(&r) && address < reinterpret_cast<const char *>(&r + 1);
+    REQUIRE( is_inline );
+    REQUIRE( r.get_value<double>() == 5.0 );
+}
+
+struct large_value { double values[32]; };
+TEST_CASE( "any_function::result can hold values too large for its inline buffer" )
+{
+    const any_function f {[]() { large_value v; for(int i=0; i<32; ++i) v.values[i] = i; return v; }};
+    auto r = f.invoke({});
+    REQUIRE( r.get_type() == any_function::type::capture<large_value>() );
+
+    auto copy = r;
+    REQUIRE( copy.get_address() != r.get_address() );
+    REQUIRE( copy.get_value<large_value>().values[31] == 31 );
+
+    auto moved = std::move(r);
+    REQUIRE( r.get_type() == any_function::type::capture<void>() );
+    REQUIRE( moved.get_value<large_value>().values[31] == 31 );
+}
+
+TEST_CASE( "any_function::result can be copied and moved when holding a std::vector" )
+{
+    const any_function f {[]() { return std::vector<double>{1,2,3}; }};
+    auto r = f.invoke({});
+    auto copy = r;
+    REQUIRE( copy.get_value<std::vector<double>>().size() == 3 );
+    r = std::move(copy);
+    REQUIRE( copy.get_type() == any_function::type::capture<void>() );
+    REQUIRE( r.get_value<std::vector<double>>().size() == 3 );
+    r = r;
+    REQUIRE( r.get_value<std::vector<double>>().size() == 3 );
+}
+
+//////////////////////////////////////////
+// Test copying and moving any_function //
+//////////////////////////////////////////
+
+TEST_CASE( "invoking an empty any_function throws std::bad_function_call" )
+{
+    const any_function f;
+    REQUIRE_THROWS_AS( f.invoke({}), std::bad_function_call );
+}
+
+TEST_CASE( "copies of any_function have independent state" )
+{
+    any_function f {counter()};
+    REQUIRE( f.invoke({}).get_value<int>() == 1 );
+
+    any_function copy {f};
+    REQUIRE( copy.invoke({}).get_value<int>() == 2 );
+    REQUIRE( copy.invoke({}).get_value<int>() == 3 );
+    REQUIRE( f.invoke({}).get_value<int>() == 2 );
+
+    any_function moved {std::move(f)};
+    REQUIRE( !f );
+    REQUIRE( moved.invoke({}).get_value<int>() == 3 );
+
+    f = moved;
+    REQUIRE( f.invoke({}).get_value<int>() == 4 );
+    REQUIRE( moved.invoke({}).get_value<int>() == 4 );
+}
+
+TEST_CASE( "any_function can hold callables too large for its inline buffer" )
+{
+    large_value v; for(int i=0; i<32; ++i) v.values[i] = i;
+    any_function f {[v](int i) { return v.values[i]; }};
+    any_function copy {f};
+    f = nullptr;
+    REQUIRE( !f );
+
+    int i = 31;
+    REQUIRE( copy.invoke({&i}).get_value<double>() == 31 );
+    f = std::move(copy);
+    REQUIRE( f.invoke({&i}).get_value<double>() == 31 );
+}
+
+struct copy_counter
+{
+    int * copies, * moves;
+    copy_counter(int * copies, int * moves) : copies(copies), moves(moves) {}
+    copy_counter(const copy_counter & r) : copies(r.copies), moves(r.moves) { ++*copies; }
+    copy_counter(copy_counter && r) : copies(r.copies), moves(r.moves) { ++*moves; }
+    int operator()() const { return 0; }
+};
+TEST_CASE( "any_function copies or moves callables into storage exactly once" )
+{
+    int copies = 0, moves = 0;
+    any_function f {copy_counter(&copies, &moves)};
+    REQUIRE( copies == 0 );
+    REQUIRE( moves == 1 );
+
+    const copy_counter c(&copies, &moves);
+    any_function g {c};
+    REQUIRE( copies == 1 );
+    REQUIRE( moves == 1 );
+
+    large_value v {};
+    copy_counter d(&copies, &moves);
+    copies = moves = 0;
+    any_function h {[v, d]() { return v.values[0]; }};
+    REQUIRE( copies == 1 );
+    REQUIRE( moves == 1 );
+}
+
+#if ANY_FUNCTION_SHARE_HEAP_CALLABLES
+TEST_CASE( "copies of any_function share large const callables" )
+{
+    large_value v {}; v.values[5] = 5;
+    const any_function f {[v](int i) { return v.values[i]; }};
+    const auto before = any_function::get_allocation_counters();
+    {
+        const any_function copy {f};
+        int i = 5;
+        REQUIRE( copy.invoke({&i}).get_value<double>() == 5 );
+        REQUIRE( f.invoke({&i}).get_value<double>() == 5 );
+    }
+    REQUIRE( any_function::get_allocation_counters().allocations == before.allocations );
+    REQUIRE( any_function::get_allocation_counters().deallocations == before.deallocations );
+}
+#endif
+
+struct large_counter { large_value v; int i; int operator()() { return ++i; } };
+TEST_CASE( "copies of any_function copy large mutable callables" )
+{
+    any_function f {large_counter{{}, 0}};
+    REQUIRE( f.invoke({}).get_value<int>() == 1 );
+
+    const auto before = any_function::get_allocation_counters();
+    any_function copy {f};
+    REQUIRE( any_function::get_allocation_counters().allocations == before.allocations + 1 );
+    REQUIRE( copy.invoke({}).get_value<int>() == 2 );
+    REQUIRE( copy.invoke({}).get_value<int>() == 3 );
+    REQUIRE( f.invoke({}).get_value<int>() == 2 );
+    REQUIRE( any_function::get_allocation_counters().allocations == before.allocations + 1 );
+}
+
+struct large_table { double values[64]; double operator()(int i) { return values[i]; } };
+TEST_CASE( "copies of any_function holding large mutable callables can be invoked from several threads" )
+{
+    large_table t {}; t.values[7] = 7;
+    const any_function f {t};
+    std::vector<any_function> copies(4, f);
+    std::vector<std::thread> threads;
+    std::atomic<int> failures(0);
+    for(auto & copy : copies) threads.emplace_back([&failures, &copy]() { for(int i=0; i<1000; ++i) { int j = 7; if(copy.invoke({&j}).get_value<double>() != 7) ++failures; } });
+    for(int i=0; i<1000; ++i) { int j = 7; if(f.invoke({&j}).get_value<double>() != 7) ++failures; }
+    for(auto & thread : threads) thread.join();
+    REQUIRE( failures == 0 );
+}
+
+///////////////////////////////////////////////
+// Test holding move-only callables uniquely //
+///////////////////////////////////////////////
+
+struct add_owned { std::unique_ptr<int> p; int operator()(int x) const { return *p + x; } };
+TEST_CASE( "unique_any_function can hold move-only callables" )
+{
+    unique_any_function f {add_owned{std::unique_ptr<int>(new int(5))}};
+    REQUIRE( f );
+    REQUIRE( f.get_result_type() == any_function::type::capture<int>() );
+    int x = 3;
+    REQUIRE( f.invoke({&x}).get_value<int>() == 8 );
+
+    unique_any_function g {std::move(f)};
+    REQUIRE( !f );
+    REQUIRE( g.invoke({&x}).get_value<int>() == 8 );
+    REQUIRE( any_function_ref{g}.invoke({&x}).get_value<int>() == 8 );
+    REQUIRE( !std::is_copy_constructible<unique_any_function>::value );
+    REQUIRE( !std::is_copy_assignable<unique_any_function>::value );
+}
+
+struct large_owned_counter { std::unique_ptr<int> p; large_value v; int operator()() { return *p += static_cast<int>(v.values[1]); } };
+TEST_CASE( "unique_any_function can hold large mutable move-only callables" )
+{
+    large_value v {}; v.values[1] = 1;
+    unique_any_function f {large_owned_counter{std::unique_ptr<int>(new int(5)), v}};
+    REQUIRE( f.invoke({}).get_value<int>() == 6 );
+    unique_any_function g {std::move(f)};
+    REQUIRE( g.invoke({}).get_value<int>() == 7 );
+}
+
+TEST_CASE( "unique_any_function can take ownership of an any_function" )
+{
+    any_function f {&global_function};
+    unique_any_function g {std::move(f)};
+    REQUIRE( !f );
+    int a = 5; double b = 12.2; float c = 3.14f;
+    REQUIRE( g.invoke({&a, &b, &c}).get_value<double>() == a*b+c );
+    REQUIRE( g.get_signature_fingerprint() == any_function::signature_fingerprint<double(int, double, float)>() );
+}
+
+/////////////////////////////////////
+// Test referring to any_functions //
+/////////////////////////////////////
+
+TEST_CASE( "any_function_ref is three pointers and trivially copyable" )
+{
+    REQUIRE( sizeof(any_function_ref) == 3 * sizeof(void *) );
+    REQUIRE( ANY_FUNCTION_IS_TRIVIALLY_COPYABLE(any_function_ref) );
+}
+
+TEST_CASE( "any_function_ref can refer to function pointers, function objects and any_functions" )
+{
+    int a = 5; double b = 12.2; float c = 3.14f;
+    const auto lambda = [](int a, double b, float c) { return a*b+c; };
+    const std::function<double(int, double, float)> function {&global_function};
+    const any_function af {&global_function};
+    for(const any_function_ref f : {any_function_ref{&global_function}, any_function_ref{lambda}, any_function_ref{function}, any_function_ref{af}})
+    {
+        REQUIRE( f );
+        REQUIRE( f.get_signature_fingerprint() == af.get_signature_fingerprint() );
+        REQUIRE( f.get_parameter_types().size() == 3 );
+        REQUIRE( f.get_result_type() == any_function::type::capture<double>() );
+        REQUIRE( f.invoke({&a, &b, &c}).get_value<double>() == a*b+c );
+        REQUIRE( f.invoke(any_function_ref::arguments<int, double, float>(a, b, c)).get_value<double>() == a*b+c );
+        REQUIRE_THROWS_AS( f.invoke(any_function_ref::arguments<int, double>(a, b)), std::invalid_argument );
+    }
+}
+
+TEST_CASE( "any_function_ref calls the referenced function object without copying it" )
+{
+    counter c;
+    const any_function_ref f {c};
+    const auto before = any_function::get_allocation_counters();
+    REQUIRE( f.invoke({}).get_value<int>() == 1 );
+    REQUIRE( f.invoke({}).get_value<int>() == 2 );
+    REQUIRE( c.i == 2 );
+    REQUIRE( any_function::get_allocation_counters().allocations == before.allocations );
+}
+
+TEST_CASE( "empty any_function_refs throw std::bad_function_call" )
+{
+    const any_function_ref f;
+    REQUIRE( !f );
+    REQUIRE( f.get_parameter_types().empty() );
+    REQUIRE_THROWS_AS( f.invoke({}), std::bad_function_call );
+    REQUIRE_THROWS_AS( any_function_ref{any_function{}}.invoke({}), std::bad_function_call );
+}
+
+/////////////////////////////////////////////
+// Test invoking with typed argument packs //
+/////////////////////////////////////////////
+
+TEST_CASE( "any_function::invoke accepts typed argument packs" )
+{
+    const any_function f {&global_function};
+    int a = 5;
+    REQUIRE( f.invoke(any_function::arguments<int, double, float>(a, 12.2, 3.14f)).get_value<double>() == a*12.2+3.14f );
+    double out;
+    f.invoke_into(any_function::type::capture<double>(), &out, any_function::arguments<int, double, float>(1, 2, 3));
+    REQUIRE( out == 5 );
+}
+
+TEST_CASE( "any_function::invoke passes references through typed argument packs" )
+{
+    const any_function f {[](int & x, std::unique_ptr<int> && p) { x += *p; p.reset(); }};
+    int x = 1;
+    std::unique_ptr<int> p {new int(2)};
+    f.invoke(any_function::arguments<int &, std::unique_ptr<int> &&>(x, std::move(p)));
+    REQUIRE( x == 3 );
+    REQUIRE( p == nullptr );
+}
+
+TEST_CASE( "any_function::invoke rejects typed argument packs of the wrong types" )
+{
+    const any_function f {&global_function};
+    REQUIRE_THROWS_AS( f.invoke(any_function::arguments<int, double, double>(1, 2, 3)), std::invalid_argument );
+    REQUIRE_THROWS_AS( f.invoke(any_function::arguments<int, double>(1, 2)), std::invalid_argument );
+    REQUIRE_THROWS_AS( f.invoke(any_function::arguments<int, const double &, float>(1, 2, 3)), std::invalid_argument );
+    REQUIRE_THROWS_AS( any_function{}.invoke(any_function::arguments<>()), std::bad_function_call );
+}
+
+////////////////////////////////////////////////
+// Test invoking into caller-provided storage //
+////////////////////////////////////////////////
+
+TEST_CASE( "any_function::invoke_into constructs the return value in caller-provided storage" )
+{
+    const any_function f {&global_function};
+    double out = 0;
+    for(int a=0; a<4; ++a)
+    {
+        double b = 2; float c = 1;
+        f.invoke_into(any_function::type::capture<double>(), &out, {&a,&b,&c});
+        REQUIRE( out == a*b+c );
+    }
+}
+
+TEST_CASE( "any_function::invoke_into writes a pointer for reference return types" )
+{
+    double x {};
+    const any_function f {[&x]() -> const double & { return x; }};
+    const double * out = nullptr;
+    f.invoke_into(any_function::type::capture<const double &>(), &out, {});
+    REQUIRE( out == &x );
+}
+
+TEST_CASE( "any_function::invoke_into rejects mismatched result types" )
+{
+    const any_function f {&global_function};
+    int a = 5; double b = 12.2; float c = 3.14f; float out;
+    REQUIRE_THROWS_AS( f.invoke_into(any_function::type::capture<float>(), &out, {&a,&b,&c}), std::invalid_argument );
+}
+
+/////////////////////////////////////////////
+// Test invoking over columns of arguments //
+/////////////////////////////////////////////
+
+TEST_CASE( "any_function::invoke_batch invokes over structure-of-arrays columns" )
+{
+    const any_function f {&global_function};
+    int a[4] = {1,2,3,4}; double b[4] = {0.5,1.5,2.5,3.5}; float c[4] = {1,1,2,2}; double out[4] = {};
+    f.invoke_batch(any_function::type::capture<double>(), {out, sizeof(double)}, {{a, sizeof(int)}, {b, sizeof(double)}, {c, sizeof(float)}}, 4);
+    for(int i=0; i<4; ++i) REQUIRE( out[i] == a[i]*b[i]+c[i] );
+}
+
+TEST_CASE( "any_function::invoke_batch supports strided and broadcast columns" )
+{
+    struct row { int a; double b; double out; } rows[3] = {{1,2,0}, {3,4,0}, {5,6,0}};
+    float c = 10;
+    const any_function f {&global_function};
+    f.invoke_batch(any_function::type::capture<double>(), {&rows[0].out, sizeof(row)}, {{&rows[0].a, sizeof(row)}, {&rows[0].b, sizeof(row)}, {&c, 0}}, 3);
+    for(auto & r : rows) REQUIRE( r.out == r.a*r.b+c );
+}
+
+TEST_CASE( "any_function::invoke_batch passes l-value references to column elements" )
+{
+    const any_function f {[](double & x) { x *= 2; }};
+    double x[3] = {1,2,3};
+    f.invoke_batch(any_function::type::capture<void>(), {nullptr, 0}, {{x, sizeof(double)}}, 3);
+    REQUIRE( x[0] == 2 );
+    REQUIRE( x[1] == 4 );
+    REQUIRE( x[2] == 6 );
+    REQUIRE_THROWS_AS( f.invoke_batch(any_function::type::capture<double>(), {nullptr, 0}, {{x, sizeof(double)}}, 3), std::invalid_argument );
+}
+
+TEST_CASE( "any_function::is_const_invocable is true only for function pointers and const function objects" )
+{
+    int n = 0;
+    REQUIRE( any_function{&global_function}.is_const_invocable() );
+    REQUIRE( any_function{[](int x) { return x; }}.is_const_invocable() );
+    REQUIRE( !any_function{[n](int x) mutable { return x+n; }}.is_const_invocable() );
+    REQUIRE( !any_function{std::function<int(int)>{[](int x) { return x; }}}.is_const_invocable() );
+    REQUIRE( !unique_any_function{std::function<int(int)>{[](int x) { return x; }}}.is_const_invocable() );
+    REQUIRE( !any_function{}.is_const_invocable() );
+}
+
+TEST_CASE( "any_function::invoke_parallel gives the same results as invoke_batch" )
+{
+    const std::size_t count = any_function::min_rows_per_thread * 4 + 3;
+    std::vector<int> a(count); std::vector<double> b(count), out(count); float c = 0.5f;
+    for(std::size_t i=0; i<count; ++i) { a[i] = int(i); b[i] = i * 0.25; }
+    const any_function f {&global_function};
+    f.invoke_parallel(any_function::type::capture<double>(), {out.data(), sizeof(double)}, {{a.data(), sizeof(int)}, {b.data(), sizeof(double)}, {&c, 0}}, count, 4);
+    for(std::size_t i=0; i<count; ++i) REQUIRE( out[i] == a[i]*b[i]+c );
+    REQUIRE_THROWS_AS( f.invoke_parallel(any_function::type::capture<int>(), {out.data(), sizeof(double)}, {{a.data(), sizeof(int)}, {b.data(), sizeof(double)}, {&c, 0}}, count, 4), std::invalid_argument );
+}
+
+TEST_CASE( "any_function::invoke_parallel invokes mutable callables serially" )
+{
+    const std::size_t count = any_function::min_rows_per_thread * 4;
+    std::vector<int> out(count);
+    const any_function f {counter()};
+    f.invoke_parallel(any_function::type::capture<int>(), {out.data(), sizeof(int)}, {}, count, 4);
+    for(std::size_t i=0; i<count; ++i) REQUIRE( out[i] == int(i+1) );
+}
+
+TEST_CASE( "any_function::invoke_parallel rethrows exceptions from worker threads" )
+{
+    const std::size_t count = any_function::min_rows_per_thread * 4;
+    std::vector<int> x(count);
+    x[count-1] = -1;
+    const any_function f {[](int x) { if(x < 0) throw std::runtime_error("negative"); }};
+    REQUIRE_THROWS_AS( f.invoke_parallel(any_function::type::capture<void>(), {nullptr, 0}, {{x.data(), sizeof(int)}}, count, 4), std::runtime_error );
+}
+
+///////////////////////////////////////
+// Test counting of heap allocations //
+///////////////////////////////////////
+
+TEST_CASE( "any_function does not allocate when invoking small callables with small results" )
+{
+    const any_function f {&global_function};
+    const auto before = any_function::get_allocation_counters();
+    int a = 5; double b = 12.2; float c = 3.14f;
+    for(int i=0; i<10; ++i) REQUIRE( f.invoke({&a,&b,&c}).get_value<double>() == a*b+c );
+    const any_function copy {f};
+    REQUIRE( any_function::get_allocation_counters().allocations == before.allocations );
+}
+
+TEST_CASE( "any_function counts allocations of large callables and results" )
+{
+    const auto before = any_function::get_allocation_counters();
+    {
+        large_value v {};
+        const any_function f {[v]() { return v; }};
+        REQUIRE( any_function::get_allocation_counters().allocations == before.allocations + 1 );
+        REQUIRE( any_function::get_allocation_counters().bytes_allocated >= before.bytes_allocated + sizeof(large_value) );
+
+        auto r = f.invoke({});
+        REQUIRE( any_function::get_allocation_counters().allocations == before.allocations + 2 );
+    }
+    REQUIRE( any_function::get_allocation_counters().deallocations == before.deallocations + 2 );
+}
+
+struct alignas(64) over_aligned_value { double values[4]; };
+
+TEST_CASE( "any_function aligns over-aligned callables and results allocated on the heap" )
+{
+    over_aligned_value v {}; v.values[2] = 2;
+    const any_function f {[v]() { REQUIRE( reinterpret_cast<std::uintptr_t>(&v) % 64 == 0 ); return v; }};
+    const any_function copy {f};
+    auto r = copy.invoke({});
+    REQUIRE( reinterpret_cast<std::uintptr_t>(r.get_address()) % 64 == 0 );
+    REQUIRE( r.get_value<over_aligned_value>().values[2] == 2 );
+}
+
+////////////////////////////////////////////
+// Test allocating from a memory_resource //
+////////////////////////////////////////////
+
+struct counting_resource : any_function::memory_resource
+{
+    int allocations = 0, deallocations = 0;
+    void * allocate(std::size_t size, std::size_t) { ++allocations; return ::operator new(size); }
+    void deallocate(void * p, std::size_t, std::size_t) { ++deallocations; ::operator delete(p); }
+};
+
+TEST_CASE( "any_function can allocate its callable from a memory_resource" )
+{
+    const int arena_allocations = ANY_FUNCTION_SHARE_HEAP_CALLABLES ? 1 : 2;
+    counting_resource m;
+    large_value v {}; v.values[3] = 3;
+    {
+        const any_function f {std::allocator_arg, &m, [v](int i) { return v.values[i]; }};
+        REQUIRE( m.allocations == 1 );
+
+        const any_function copy {f};
+        REQUIRE( m.allocations == 1 ); // Plain copies allocate from the default resource
+
+        const any_function arena_copy {std::allocator_arg, &m, f};
+        REQUIRE( m.allocations == arena_allocations ); // Copies from the same resource share the callable, if enabled
+
+        int i = 3;
+        REQUIRE( arena_copy.invoke({&i}).get_value<double>() == 3 );
+        REQUIRE( m.deallocations == 0 );
+    }
+    REQUIRE( m.deallocations == arena_allocations );
+}
+
+TEST_CASE( "any_function can allocate its result from a memory_resource" )
+{
+    counting_resource m;
+    const any_function f {[]() { large_value v {}; v.values[31] = 31; return v; }};
+    {
+        auto r = f.invoke(&m, {});
+        REQUIRE( m.allocations == 1 );
+        REQUIRE( r.get_value<large_value>().values[31] == 31 );
+
+        auto copy = r;
+        REQUIRE( m.allocations == 1 );
+
+        auto moved = std::move(r);
+        REQUIRE( m.deallocations == 0 );
+    }
+    REQUIRE( m.deallocations == 1 );
+
+    auto r = any_function::result::capture<std::vector<double>>(&m, std::vector<double>(100));
+    REQUIRE( m.allocations == (sizeof(std::vector<double>) > ANY_FUNCTION_RESULT_INLINE_SIZE ? 2 : 1) );
+    REQUIRE( r.get_value<std::vector<double>>().size() == 100 );
+}
+
+#ifdef ANY_FUNCTION_HAS_PMR
+TEST_CASE( "any_function can allocate from a std::pmr::memory_resource" )
+{
+    char buffer[1024];
+    std::pmr::monotonic_buffer_resource arena {buffer, sizeof(buffer), std::pmr::null_memory_resource()};
+    any_function::pmr_resource m {&arena};
+    large_value v {}; v.values[3] = 3;
+    const any_function f {std::allocator_arg, &m, [v](int i) { return v.values[i]; }};
+    int i = 3;
+    REQUIRE( f.invoke({&i}).get_value<double>() == 3 );
+}
+#endif
+
+/////////////////////////////////////
+// Test binding arguments to calls //
+/////////////////////////////////////
+
+TEST_CASE( "any_function::bind stores copies of its arguments" )
+{
+    const any_function f {&global_function};
+    int a = 5;
+    auto call = f.bind(a, 12.2, 3.14f);
+    a = 0;
+    REQUIRE( call );
+    REQUIRE( call.invoke().get_value<double>() == 5*12.2+3.14f );
+    REQUIRE( call.invoke().get_value<double>() == 5*12.2+3.14f );
+    double out;
+    call.invoke_into(any_function::type::capture<double>(), &out);
+    REQUIRE( out == 5*12.2+3.14f );
+    REQUIRE_THROWS_AS( call.invoke_into(any_function::type::capture<float>(), &out), std::invalid_argument );
+}
+
+TEST_CASE( "any_function::bind checks its arguments against the parameter types" )
+{
+    const any_function f {[](const std::string & s, int & n) { n += int(s.size()); return n; }};
+    REQUIRE_THROWS_AS( f.bind(std::string("abc")), std::invalid_argument );
+    REQUIRE_THROWS_AS( f.bind("abc", 1), std::invalid_argument );
+    auto call = f.bind(std::string("abc"), 1);
+    REQUIRE( call.invoke().get_value<int>() == 4 );
+    REQUIRE( call.invoke().get_value<int>() == 7 );
+}
+
+TEST_CASE( "bound calls can be moved to another thread" )
+{
+    large_value v {}; v.values[0] = 2;
+    any_function::bound_call call = any_function{[](const large_value & v, const std::unique_ptr<int> & p) { return v.values[0] * *p; }}.bind(v, std::unique_ptr<int>(new int(21)));
+    double result = 0;
+    std::thread t([&result](any_function::bound_call call) { result = call.invoke().get_value<double>(); }, std::move(call));
+    t.join();
+    REQUIRE( !call );
+    REQUIRE( result == 42 );
+    REQUIRE_THROWS_AS( call.invoke(), std::bad_function_call );
+}
+
+///////////////////////////////////////
+// Test queueing calls for later use //
+///////////////////////////////////////
+
+TEST_CASE( "any_function_queue invokes calls in the order they were pushed" )
+{
+    std::string log;
+    any_function_queue<> q {4};
+    REQUIRE( q.capacity() == 4 );
+    std::string hello = "hello";
+    REQUIRE( q.try_push([&log](const std::string & s, int n) { for(int i=0; i<n; ++i) log += s; }, hello, 2) );
+    REQUIRE( q.try_push([&log](std::string && s) { log += std::move(s); }, std::string(" world")) );
+    REQUIRE( q.try_push([&log]() { log += "!"; }) );
+    REQUIRE( log.empty() );
+    REQUIRE( q.drain() == 3 );
+    REQUIRE( log == "hellohello world!" );
+    REQUIRE( !q.try_pop() );
+}
+
+TEST_CASE( "any_function_queue rejects calls when full or when the arguments do not match" )
+{
+    any_function_queue<> q {2};
+    const any_function f {[](int) {}};
+    for(int i=0; i<2; ++i) REQUIRE( q.try_push(any_function(f), i) );
+    REQUIRE( !q.try_push(any_function(f), 2) );
+    REQUIRE_THROWS_AS( q.try_push(any_function(f), 2.0), std::invalid_argument );
+    REQUIRE_THROWS_AS( q.try_push(any_function(f)), std::invalid_argument );
+    REQUIRE( q.try_pop() );
+    REQUIRE( q.try_push(any_function(f), 2) );
+}
+
+TEST_CASE( "any_function_queue destroys the arguments of calls which are never invoked" )
+{
+    auto p = std::make_shared<int>(5);
+    {
+        any_function_queue<> q {2};
+        REQUIRE( q.try_push([](std::shared_ptr<int>) {}, p) );
+        REQUIRE( p.use_count() == 2 );
+    }
+    REQUIRE( p.use_count() == 1 );
+}
+
+TEST_CASE( "any_function_queue accepts calls from several producers" )
+{
+    const int producers = 4, calls = 10000;
+    long long sum = 0;
+    int count = 0;
+    any_function_queue<> q {64};
+    std::vector<std::thread> threads;
+    for(int t=0; t<producers; ++t) threads.emplace_back([&q, &sum, t]() { for(int i=0; i<calls; ++i) while(!q.try_push([&sum](int x) { sum += x; }, t*calls+i)) std::this_thread::yield(); });
+    while(count < producers*calls) if(q.try_pop()) ++count; else std::this_thread::yield();
+    for(auto & t : threads) t.join();
+    const long long n = producers*calls;
+    REQUIRE( sum == n*(n-1)/2 );
+}
+
+////////////////////////////////////////
+// Test invoking calls asynchronously //
+////////////////////////////////////////
+
+// Runs each function on a new thread, which is joined when the executor is destroyed
+struct thread_executor
+{
+    std::vector<std::thread> threads;
+    ~thread_executor() { for(auto & t : threads) t.join(); }
+    template<class F> void execute(F && f) { threads.emplace_back(std::forward<F>(f)); }
+};
+
+TEST_CASE( "invoke_async returns a future for the result of the call" )
+{
+    const any_function f {&global_function};
+    auto future = invoke_async(any_function_inline_executor{}, f, 5, 12.2, 3.14f);
+    REQUIRE( future.valid() );
+    REQUIRE( future.is_ready() );
+    REQUIRE( future.get().get_value<double>() == 5*12.2+3.14f );
+    REQUIRE( !future.valid() );
+}
+
+TEST_CASE( "invoke_async counts the allocation of its shared state" )
+{
+    const any_function f {&global_function};
+    const auto before = any_function::get_allocation_counters();
+    {
+        auto future = invoke_async(any_function_inline_executor{}, f, 5, 12.2, 3.14f);
+        REQUIRE( any_function::get_allocation_counters().allocations == before.allocations + 1 );
+        REQUIRE( future.get().get_value<double>() == 5*12.2+3.14f );
+    }
+    REQUIRE( any_function::get_allocation_counters().deallocations == before.deallocations + 1 );
+}
+
+TEST_CASE( "invoke_async can run calls on other threads" )
+{
+    thread_executor executor;
+    std::vector<any_function_future> futures;
+    const any_function f {[](int x) { return x*x; }};
+    for(int i=0; i<8; ++i) futures.push_back(invoke_async(executor, f, i));
+    for(int i=0; i<8; ++i) REQUIRE( futures[i].get().get_value<int>() == i*i );
+}
+
+TEST_CASE( "any_function_future rethrows exceptions thrown by the call" )
+{
+    thread_executor executor;
+    auto future = invoke_async(executor, any_function{[]() -> int { throw std::runtime_error("failed"); }}.bind());
+    future.wait();
+    REQUIRE( future.is_ready() );
+    REQUIRE_THROWS_AS( future.get(), std::runtime_error );
+}
+
+struct dropping_executor { template<class F> void execute(F && f) const { std::function<void()> copy {f}; } };
+TEST_CASE( "any_function_future reports a broken promise if the executor drops the call" )
+{
+    int calls = 0;
+    auto future = invoke_async(dropping_executor{}, any_function{[&calls]() { return ++calls; }}.bind());
+    REQUIRE( future.is_ready() );
+    future.wait();
+    try { future.get(); FAIL( "expected std::future_error" ); }
+    catch(const std::future_error & e) { REQUIRE( e.code() == std::future_errc::broken_promise ); }
+    REQUIRE( calls == 0 );
+}
+
+#ifdef ANY_FUNCTION_HAS_COROUTINES
+struct eager_coroutine
+{
+    struct promise_type
+    {
+        eager_coroutine get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+eager_coroutine square_async(thread_executor & executor, int x, std::atomic<int> & out)
+{
+    const any_function f {[](int x) { return x*x; }};
+    auto r = co_await invoke_async(executor, f, x);
+    out = r.get_value<int>();
+}
+
+TEST_CASE( "any_function_future can be awaited by coroutines" )
+{
+    std::atomic<int> out {0};
+    {
+        thread_executor executor;
+        square_async(executor, 7, out);
+    }
+    REQUIRE( out == 49 );
+}
+#endif
+
+////////////////////////////////////////////////
+// Test running calls on a work-stealing pool //
+////////////////////////////////////////////////
+
+TEST_CASE( "any_function_executor runs every submitted call" )
+{
+    std::atomic<int> sum {0};
+    any_function_executor executor {4};
+    REQUIRE( executor.thread_count() == 4 );
+    const any_function f {[&sum](int x) { sum += x; }};
+    for(int i=0; i<1000; ++i) executor.submit(f, i);
+    executor.wait_idle();
+    REQUIRE( sum == 1000*999/2 );
+}
+
+TEST_CASE( "any_function_executor counts the allocations of its workers and submitted calls" )
+{
+    const any_function f {[](int) {}};
+    const auto before = any_function::get_allocation_counters();
+    any_function_executor executor {2};
+    REQUIRE( any_function::get_allocation_counters().allocations == before.allocations + 2 );
+    executor.submit(f, 1);
+    REQUIRE( any_function::get_allocation_counters().allocations == before.allocations + 3 );
+    executor.wait_idle();
+}
+
+TEST_CASE( "any_function_executor runs calls submitted by other calls" )
+{
+    std::atomic<int> sum {0};
+    any_function_executor executor {4};
+    const any_function leaf {[&sum](int x) { sum += x; }};
+    const any_function root {[&executor, &leaf](int n) { for(int i=0; i<n; ++i) executor.submit(leaf, i); }};
+    for(int i=0; i<4; ++i) executor.submit(root, 1000);
+    executor.wait_idle();
+    REQUIRE( sum == 4*1000*999/2 );
+}
+
+TEST_CASE( "any_function_executor::wait_idle rethrows exceptions thrown by calls" )
+{
+    any_function_executor executor {2};
+    executor.submit(any_function{[]() { throw std::runtime_error("failed"); }}.bind());
+    REQUIRE_THROWS_AS( executor.wait_idle(), std::runtime_error );
+    executor.wait_idle();
+}
+
+TEST_CASE( "any_function_executor can be used with invoke_async" )
+{
+    any_function_executor executor {2};
+    std::vector<any_function_future> futures;
+    const any_function f {[](int x) { return x*x; }};
+    for(int i=0; i<100; ++i) futures.push_back(invoke_async(executor, f, i));
+    for(int i=0; i<100; ++i) REQUIRE( futures[i].get().get_value<int>() == i*i );
+}
+
+///////////////////////////////////////
+// Test looking up functions by name //
+///////////////////////////////////////
+
+TEST_CASE( "any_function_registry finds every function registered under a name" )
+{
+    any_function_registry registry;
+    for(int i=0; i<1000; ++i) registry.add("f" + std::to_string(i), any_function{[i]() { return i; }});
+    REQUIRE( registry.find("f7")->invoke({}).get_value<int>() == 7 );
+    registry.freeze();
+    REQUIRE( registry.is_frozen() );
+    REQUIRE( registry.size() == 1000 );
+    for(int i=0; i<1000; ++i) REQUIRE( registry.at("f" + std::to_string(i)).invoke({}).get_value<int>() == i );
+    REQUIRE( registry.find("f1000") == nullptr );
+    REQUIRE( registry.find("") == nullptr );
+    REQUIRE_THROWS_AS( registry.at("g"), std::out_of_range );
+    REQUIRE_THROWS_AS( registry.add("g", any_function{}), std::logic_error );
+}
+
+TEST_CASE( "any_function_registry can check the signature of the function it finds" )
+{
+    any_function_registry registry;
+    registry.add("square", any_function{[](int x) { return x*x; }});
+    registry.freeze();
+    REQUIRE( registry.find<int(int)>("square") != nullptr );
+    REQUIRE( registry.find<int(double)>("square") == nullptr );
+    REQUIRE( registry.find<int(int)>("cube") == nullptr );
+}
+
+TEST_CASE( "any_function_registry rejects duplicate names when frozen" )
+{
+    any_function_registry registry;
+    registry.add("a", any_function{&global_function});
+    registry.add("b", any_function{&global_function});
+    registry.add("a", any_function{&global_function});
+    REQUIRE_THROWS_AS( registry.freeze(), std::invalid_argument );
+    REQUIRE( !registry.is_frozen() );
+
+    any_function_registry empty;
+    empty.freeze();
+    REQUIRE( empty.find("a") == nullptr );
+}
+
+////////////////////////////////////////////////
+// Test resolving calls against overload sets //
+////////////////////////////////////////////////
+
+TEST_CASE( "any_function_set dispatches calls by the types of their arguments" )
+{
+    any_function_set set;
+    set.add(any_function{[](int) { return 1; }});
+    set.add(any_function{[](const double &) { return 2; }});
+    set.add(any_function{[](int, double) { return 3; }});
+    set.add(any_function{[]() { return 4; }});
+    REQUIRE( set.size() == 4 );
+
+    int i = 5; double d = 2.5;
+    const auto int_type = any_function::type::capture<int>(), double_type = any_function::type::capture<double>();
+    REQUIRE( set.invoke({int_type}, {&i}).get_value<int>() == 1 );
+    REQUIRE( set.invoke({double_type}, {&d}).get_value<int>() == 2 );
+    REQUIRE( set.invoke({int_type, double_type}, {&i, &d}).get_value<int>() == 3 );
+    REQUIRE( set.invoke({}, {}).get_value<int>() == 4 );
+    REQUIRE( set.resolve({any_function::type::capture<const int &>()}) == &set[0] );
+    REQUIRE( set.resolve({double_type, int_type}) == nullptr );
+    REQUIRE( set.resolve({int_type, int_type, int_type}) == nullptr );
+    REQUIRE_THROWS_AS( set.invoke({double_type, double_type}, {&d, &d}), std::invalid_argument );
+}
+
+TEST_CASE( "any_function_set rejects ambiguous overloads" )
+{
+    any_function_set set;
+    set.add(any_function{[](int x) { return x; }});
+    REQUIRE_THROWS_AS( set.add(any_function{[](const int & x) { return x; }}), std::invalid_argument );
+    REQUIRE_THROWS_AS( set.add(any_function{}), std::invalid_argument );
+    REQUIRE( set.size() == 1 );
+}
+
+template<class T> void add_overloads_on(any_function_set & set)
+{
+    set.add(any_function{[](T, int) {}});
+    set.add(any_function{[](T, double) {}});
+    set.add(any_function{[](T, float) {}});
+    set.add(any_function{[](T, char) {}});
+    set.add(any_function{[](T, long) {}});
+}
+
+TEST_CASE( "any_function_set resolves every member of a large set" )
+{
+    any_function_set set;
+    add_overloads_on<int>(set);
+    add_overloads_on<double>(set);
+    add_overloads_on<float>(set);
+    add_overloads_on<char>(set);
+    add_overloads_on<long>(set);
+    REQUIRE( set.size() == 25 );
+    for(std::size_t i=0; i<set.size(); ++i) REQUIRE( set.resolve(set[i].get_parameter_types().begin(), 2) == &set[i] );
+}
+
+TEST_CASE( "any_function_set::call_site caches the member it resolved to" )
+{
+    any_function_set set, other;
+    set.add(any_function{[](int x) { return x*2; }});
+    set.add(any_function{[](double x) { return x/2; }});
+    other.add(any_function{[](int x) { return x*3; }});
+
+    any_function_set::call_site site;
+    int i = 6; double d = 3.0;
+    const auto int_type = any_function::type::capture<int>(), double_type = any_function::type::capture<double>();
+    for(int n=0; n<3; ++n)
+    {
+        REQUIRE( site.invoke(set, {int_type}, {&i}).get_value<int>() == 12 );
+        REQUIRE( site.invoke(set, {int_type}, {&i}).get_value<int>() == 12 );
+        REQUIRE( site.invoke(set, {double_type}, {&d}).get_value<double>() == 1.5 );
+        REQUIRE( site.invoke(other, {int_type}, {&i}).get_value<int>() == 18 );
+    }
+    REQUIRE( site.resolve(other, {double_type}) == nullptr );
+    REQUIRE( site.resolve(set, {double_type}) == &set[1] );
+}
+
+TEST_CASE( "any_function_set::call_site checks its cached member after the set is reassigned" )
+{
+    any_function_set set;
+    set.add(any_function{[](int x) { return x*2; }});
+    set.add(any_function{[](double x) { return x/2; }});
+
+    any_function_set::call_site site;
+    double d = 3.0;
+    const auto double_type = any_function::type::capture<double>();
+    REQUIRE( site.invoke(set, {double_type}, {&d}).get_value<double>() == 1.5 );
+    set = any_function_set();
+    REQUIRE( site.resolve(set, {double_type}) == nullptr );
+    set.add(any_function{[](double x) { return x*4; }});
+    REQUIRE( site.invoke(set, {double_type}, {&d}).get_value<double>() == 12 );
+}
+
+///////////////////////////////////
+// Test memoizing pure functions //
+///////////////////////////////////
+
+struct point { int x, y; bool operator == (const point & r) const { return x == r.x && y == r.y; } };
+struct point_hash { std::size_t operator() (const point & p) const { return std::hash<int>()(p.x) * 31 + std::hash<int>()(p.y); } };
+
+TEST_CASE( "any_function_memo skips the function for repeated arguments" )
+{
+    int calls = 0;
+    any_function_memo memo {any_function{[&calls](int a, const std::string & b) { ++calls; return b + std::to_string(a); }}, 64};
+    int a = 1; std::string b = "x";
+    REQUIRE( memo.invoke({&a, &b}).get_value<std::string>() == "x1" );
+    REQUIRE( memo.invoke({&a, &b}).get_value<std::string>() == "x1" );
+    REQUIRE( memo.invoke(any_function::arguments<int, const std::string &>(a, b)).get_value<std::string>() == "x1" );
+    b = "y";
+    REQUIRE( memo.invoke({&a, &b}).get_value<std::string>() == "y1" );
+    REQUIRE( calls == 2 );
+    REQUIRE( memo.hits() == 2 );
+    REQUIRE( memo.misses() == 2 );
+    REQUIRE( memo.size() == 2 );
+    REQUIRE_THROWS_AS( memo.invoke(any_function::arguments<double, const std::string &>(1.0, b)), std::invalid_argument );
+
+    memo.clear();
+    REQUIRE( memo.size() == 0 );
+    REQUIRE( memo.invoke({&a, &b}).get_value<std::string>() == "y1" );
+    REQUIRE( calls == 3 );
+}
+
+TEST_CASE( "any_function_memo keys on argument values from before the call" )
+{
+    int calls = 0;
+    any_function_memo memo {any_function{[&calls](std::string && s) { ++calls; std::string t = std::move(s); return t.size(); }}, 64};
+    std::string s = "hello";
+    REQUIRE( memo.invoke({&s}).get_value<std::size_t>() == 5 );
+    s = "hello";
+    REQUIRE( memo.invoke(any_function::arguments<std::string &&>(std::move(s))).get_value<std::size_t>() == 5 );
+    REQUIRE( calls == 1 );
+    REQUIRE( memo.size() == 1 );
+    s = "";
+    REQUIRE( memo.invoke({&s}).get_value<std::size_t>() == 0 );
+    REQUIRE( calls == 2 );
+}
+
+TEST_CASE( "any_function_memo counts the allocations of its shards" )
+{
+    const any_function f {[](int x) { return x*x; }};
+    const auto before = any_function::get_allocation_counters();
+    {
+        any_function_memo memo {f, 64, 4};
+        REQUIRE( any_function::get_allocation_counters().allocations == before.allocations + 4 );
+    }
+    REQUIRE( any_function::get_allocation_counters().deallocations == before.deallocations + 4 );
+}
+
+TEST_CASE( "any_function_memo evicts the least recently used results" )
+{
+    int calls = 0;
+    any_function_memo memo {any_function{[&calls](int x) { ++calls; return x*x; }}, 2, 1};
+    REQUIRE( memo.capacity() == 2 );
+    int v[] = {1, 2, 3};
+    memo.invoke({&v[0]}); memo.invoke({&v[1]}); memo.invoke({&v[0]}); memo.invoke({&v[2]});
+    REQUIRE( memo.size() == 2 );
+    REQUIRE( calls == 3 );
+    REQUIRE( memo.invoke({&v[0]}).get_value<int>() == 1 );
+    REQUIRE( calls == 3 );
+    REQUIRE( memo.invoke({&v[1]}).get_value<int>() == 4 );
+    REQUIRE( calls == 4 );
+}
+
+TEST_CASE( "any_function_memo requires a registered hash for each parameter type" )
+{
+    const any_function f {[](const point & p) { return p.x + p.y; }};
+    REQUIRE_THROWS_AS( any_function_memo(f, 16), std::invalid_argument );
+    any_function_memo::register_type<point, point_hash>();
+    any_function_memo memo {f, 16};
+    point p {3, 4};
+    REQUIRE( memo.invoke({&p}).get_value<int>() == 7 );
+    REQUIRE( memo.invoke({&p}).get_value<int>() == 7 );
+    REQUIRE( memo.hits() == 1 );
+}
+
+TEST_CASE( "any_function_memo can be shared between threads" )
+{
+    any_function_memo memo {any_function{[](int x) { return x*x; }}, 1024};
+    std::vector<std::thread> threads;
+    std::atomic<bool> ok {true};
+    for(int t=0; t<4; ++t) threads.emplace_back([&memo, &ok]() { for(int i=0; i<1000; ++i) { int x = i % 100; if(memo.invoke({&x}).get_value<int>() != x*x) ok = false; } });
+    for(auto & t : threads) t.join();
+    REQUIRE( ok );
+    REQUIRE( memo.hits() + memo.misses() == 4000 );
+    REQUIRE( memo.size() == 100 );
+}
+
+/////////////////////////////////////////
+// Test invoking with packed arguments //
+/////////////////////////////////////////
+
+TEST_CASE( "any_function can decode packed arguments" )
+{
+    const any_function f {[](char a, int b, const double & c) { return a + b + c; }};
+    REQUIRE( f.is_packable() );
+    REQUIRE( f.get_packed_size() == sizeof(char) + sizeof(int) + sizeof(double) );
+
+    // Pack the arguments at every offset within a buffer, so that some are misaligned
+    alignas(double) char buffer[64];
+    for(int offset=0; offset<8; ++offset)
+    {
+        char a = 1; int b = 20; double c = 300.5;
+        std::memcpy(buffer + offset, &a, sizeof(a));
+        std::memcpy(buffer + offset + sizeof(a), &b, sizeof(b));
+        std::memcpy(buffer + offset + sizeof(a) + sizeof(b), &c, sizeof(c));
+        REQUIRE( f.invoke_packed(buffer + offset, f.get_packed_size()).get_value<double>() == 321.5 );
+        double out;
+        f.invoke_packed_into(any_function::type::capture<double>(), &out, buffer + offset, f.get_packed_size());
+        REQUIRE( out == 321.5 );
+    }
+    REQUIRE_THROWS_AS( f.invoke_packed(buffer, 3), std::invalid_argument );
+}
+
+TEST_CASE( "any_function passes aligned packed arguments in place" )
+{
+    const any_function f {[](const int & a, int && b) { return std::make_pair(&a, &b); }};
+    REQUIRE( f.is_packable() );
+    alignas(int) char buffer[2*sizeof(int)] = {};
+    auto r = f.invoke_packed(buffer, sizeof(buffer)).get_value<std::pair<const int *, int *>>();
+    REQUIRE( static_cast<const void *>(r.first) == buffer );
+    REQUIRE( static_cast<const void *>(r.second) != buffer + sizeof(int) );
+}
+
+TEST_CASE( "any_function rejects packed arguments for parameters which cannot be packed" )
+{
+    const any_function g {[](const std::string & s) { return s.size(); }};
+    const any_function h {[](int & x) { ++x; }};
+    REQUIRE( !g.is_packable() );
+    REQUIRE( !h.is_packable() );
+    REQUIRE_THROWS_AS( g.invoke_packed(nullptr, 0), std::invalid_argument );
+    REQUIRE_THROWS_AS( any_function{}.invoke_packed(nullptr, 0), std::bad_function_call );
+    REQUIRE( any_function{[]() { return 5; }}.invoke_packed(nullptr, 0).get_value<int>() == 5 );
+}
+
+////////////////////////////////////
+// Test serializing return values //
+////////////////////////////////////
+
+struct message { std::string text; };
+template<> struct any_function_serializer<message>
+{
+    static std::size_t serialize(const message & m, void * out, std::size_t capacity)
+    {
+        if(capacity < m.text.size() + 1) throw std::length_error("message does not fit");
+        std::memcpy(out, m.text.c_str(), m.text.size() + 1);
+        return m.text.size() + 1;
+    }
+};
+
+TEST_CASE( "any_function can serialize its return value into a byte buffer" )
+{
+    const any_function f {&global_function};
+    REQUIRE( f.is_result_serializable() );
+    int a = 5; double b = 12.2; float c = 3.14f;
+    char buffer[16];
+    REQUIRE( f.invoke_serialized(buffer + 1, sizeof(buffer) - 1, {&a, &b, &c}) == sizeof(double) );
+    double out;
+    std::memcpy(&out, buffer + 1, sizeof(out));
+    REQUIRE( out == 5*12.2+3.14f );
+    REQUIRE_THROWS_AS( f.invoke_serialized(buffer, 4, {&a, &b, &c}), std::length_error );
+
+    double x = 2.5;
+    const any_function g {[&x]() -> const double & { return x; }};
+    REQUIRE( g.invoke_serialized(buffer, sizeof(buffer), {}) == sizeof(double) );
+    std::memcpy(&out, buffer, sizeof(out));
+    REQUIRE( out == 2.5 );
+
+    REQUIRE( any_function{[]() {}}.invoke_serialized(nullptr, 0, {}) == 0 );
+    REQUIRE_THROWS_AS( any_function{}.invoke_serialized(buffer, sizeof(buffer), {}), std::bad_function_call );
+}
+
+TEST_CASE( "any_function serializes user types with a specialized serializer" )
+{
+    const any_function f {[](int n) { return message{std::string(n, 'x')}; }};
+    const any_function g {[](int n) { return std::vector<int>(n); }};
+    REQUIRE( f.is_result_serializable() );
+    REQUIRE( !g.is_result_serializable() );
+    int n = 3;
+    char buffer[8];
+    REQUIRE( f.invoke_serialized(buffer, sizeof(buffer), {&n}) == 4 );
+    const bool matches = std::strcmp(buffer, "xxx") == 0;
+    REQUIRE( matches );
+    n = 10;
+    REQUIRE_THROWS_AS( f.invoke_serialized(buffer, sizeof(buffer), {&n}), std::length_error );
+    REQUIRE_THROWS_AS( g.invoke_serialized(buffer, sizeof(buffer), {&n}), std::invalid_argument );
+}
+
+TEST_CASE( "any_function can answer a packed request without allocating" )
+{
+    const any_function f {[](int a, double b, const large_value & c) { large_value r = {}; for(int i=0; i<16; ++i) r.values[i] = c.values[i] * a + b; return r; }};
+    REQUIRE( f.get_result_type() == any_function::type::capture<large_value>() );
+    std::vector<char> request(f.get_packed_size()), response(sizeof(large_value));
+    int a = 2; double b = 0.5; large_value c = {}; for(int i=0; i<16; ++i) c.values[i] = i;
+    std::memcpy(request.data(), &a, sizeof(a));
+    std::memcpy(request.data() + sizeof(a), &b, sizeof(b));
+    std::memcpy(request.data() + sizeof(a) + sizeof(b), &c, sizeof(c));
+
+    const auto before = any_function::get_allocation_counters();
+    REQUIRE( f.invoke_packed_serialized(response.data(), response.size(), request.data(), request.size()) == sizeof(large_value) );
+    REQUIRE( any_function::get_allocation_counters().allocations == before.allocations );
+
+    large_value r;
+    std::memcpy(&r, response.data(), sizeof(r));
+    for(int i=0; i<16; ++i) REQUIRE( r.values[i] == i*2 + 0.5 );
+}